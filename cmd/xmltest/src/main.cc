@@ -1,5 +1,10 @@
 #include "xml_operations.h"
+#include "xml_arena.h"
 #include "xml_auto_serializer.h"
+#include "xml_index.h"
+#include "xml_memory.h"
+#include "xml_printer.h"
+#include "xml_shared_tree.h"
 
 #include "absl/strings/str_cat.h"
 #include "pugixml.hpp"
@@ -9,9 +14,11 @@
 #include "parse_args.h"
 
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <fstream>
 #include <iostream>
+#include <iterator>
 #include <sstream>
 #include <vector>
 
@@ -47,14 +54,12 @@ void apply_patch(std::shared_ptr<pugi::xml_document> doc, const fs::path& modPat
         modPath.filename().string(),
         mainPatchFile,
         fs::absolute(modPath));
-    for (auto& operation : operations) {
-        operation.Apply(doc);
-    }
+    XmlOperation::ApplyAll(operations, doc);
 }
 
 int command_show(const XmltestParameters& params, std::ostream& out) {
     auto target_doc = XmlAutoSerializer::read(params.targetPath);
-    const auto xpath = "//Asset[Values/Standard/GUID='" + params.patchPath.string() + "']";
+    const auto xpath = "//Asset[Values/Standard/GUID='" + params.guid + "']";
     const auto nodes = target_doc->select_nodes(xpath.c_str());
     for (pugi::xpath_node node : nodes) {
         node.node().print(out, "\t");
@@ -64,9 +69,165 @@ int command_show(const XmltestParameters& params, std::ostream& out) {
     return 0;
 }
 
+/// @brief Milliseconds run takes.
+template <typename Run>
+double bench_time(Run&& run) {
+    auto start = std::chrono::high_resolution_clock::now();
+    run();
+    auto end = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1000.0;
+}
+
+void bench_row(std::ostream& out, const char* name, double value, const char* unit) {
+    out << fmt::format("{:<16} {:>12.1f} {}", name, value, unit) << std::endl;
+}
+
+/// @brief A row comparing two ways, below a header naming them.
+void bench_row(std::ostream& out, const char* name, double first, double second, const char* unit) {
+    out << fmt::format("{:<16} {:>12.1f} {:>12.1f} {}", name, first, second, unit) << std::endl;
+}
+
+void bench_header(std::ostream& out, const char* first, const char* second) {
+    out << fmt::format("{:<16} {:>12} {:>12}", "", first, second) << std::endl;
+}
+
+/// @brief What pugixml alone does, for the other benchmarks to compare against.
+struct BenchBaseline {
+    double load_time = 0;
+    double print_time = 0;
+    std::string xml;
+    std::shared_ptr<XmlIndex> index;
+};
+
+BenchBaseline bench_pugixml(std::shared_ptr<pugi::xml_document> doc, double load_time, std::ostream& out) {
+    BenchBaseline baseline;
+    baseline.load_time = load_time;
+
+    std::vector<std::string> guids;
+    for (auto guid : doc->select_nodes("//Asset/Values/Standard/GUID")) {
+        guids.emplace_back(guid.node().text().get());
+    }
+
+    size_t found = 0;
+    const auto index_time = bench_time([&]() { baseline.index = XmlIndex::Get(doc); });
+    const auto find_time = bench_time([&]() {
+        for (const auto& guid : guids) {
+            found += baseline.index->FindAsset(guid) ? 1 : 0;
+        }
+    });
+
+    size_t elements = 0;
+    const auto walk = [&elements](pugi::xml_node node, const auto& walk) -> void {
+        for (auto child = node.first_child(); child; child = child.next_sibling()) {
+            elements += child.type() == pugi::node_element ? 1 : 0;
+            walk(child, walk);
+        }
+    };
+    const auto walk_time = bench_time([&]() { walk(*doc, walk); });
+
+    std::ostringstream xml;
+    baseline.print_time = bench_time([&]() { doc->print(xml, "", pugi::format_raw); });
+    baseline.xml = xml.str();
+
+    out << fmt::format("{} assets, found {}, walked {} elements", guids.size(), found, elements) << std::endl;
+    bench_row(out, "load", load_time, "ms");
+    bench_row(out, "index", index_time, "ms");
+    bench_row(out, "find all GUIDs", find_time, "ms");
+    bench_row(out, "walk", walk_time, "ms");
+    bench_row(out, "print raw", baseline.print_time, "ms");
+    return baseline;
+}
+
+/// @brief The same deep copy with and without an arena.
+void bench_arena(std::shared_ptr<pugi::xml_document> doc, std::ostream& out) {
+    auto heap_copy = std::make_shared<pugi::xml_document>();
+    auto arena_copy = XmlArena::MakeDocument();
+    auto stats = XmlArena::GetStats();
+    const auto heap_copy_time = bench_time([&]() { heap_copy->reset(*doc); });
+    const auto heap_allocations = XmlArena::GetStats().heap_allocations - stats.heap_allocations;
+    const auto heap_free_time = bench_time([&]() { heap_copy.reset(); });
+    stats = XmlArena::GetStats();
+    const auto arena_copy_time = bench_time([&]() {
+        XmlArena::Scope scope(arena_copy);
+        arena_copy->reset(*doc);
+    });
+    const auto arena_allocations = XmlArena::GetStats().arena_allocations - stats.arena_allocations;
+    const auto arena_free_time = bench_time([&]() { arena_copy.reset(); });
+
+    bench_header(out, "malloc", "arena");
+    bench_row(out, "allocations", heap_allocations, arena_allocations, "");
+    bench_row(out, "copy", heap_copy_time, arena_copy_time, "ms");
+    bench_row(out, "free", heap_free_time, arena_free_time, "ms");
+}
+
+/// @brief The same document printed by pugixml alone and split up between threads.
+void bench_parallel_print(std::shared_ptr<pugi::xml_document> doc, const BenchBaseline& baseline,
+                          std::ostream& out) {
+    std::ostringstream xml;
+    const auto print_time = bench_time([&]() {
+        pugi::xml_writer_stream writer{xml};
+        XmlPrinter::Print(*doc, writer, "", pugi::format_raw);
+    });
+
+    bench_header(out, "serial", "parallel");
+    bench_row(out, "print raw", baseline.print_time, print_time, "ms");
+    out << fmt::format("parallel print: {}", baseline.xml == xml.str() ? "same" : "different") << std::endl;
+}
+
+/// @brief Identical subtrees stored and printed once.
+///        The asset with guid is copied back from it to compare with the same printer.
+void bench_shared_tree(std::shared_ptr<pugi::xml_document> doc, const BenchBaseline& baseline,
+                       const std::string& guid, std::ostream& out) {
+    std::shared_ptr<XmlSharedTree> shared;
+    const auto build_time = bench_time([&]() { shared = XmlSharedTree::Build(*doc); });
+    std::ostringstream xml;
+    const auto print_time = bench_time([&]() { shared->Print(xml, shared->Root()); });
+    const auto stats = shared->GetStats();
+    out << fmt::format("{} of {} nodes unique, {:.1f} of {:.1f} MB saved", stats.unique_nodes, stats.nodes,
+                       stats.saved_bytes / 1048576.0, stats.bytes / 1048576.0)
+        << std::endl;
+    bench_header(out, "pugixml", "shared");
+    bench_row(out, "load", baseline.load_time, baseline.load_time + build_time, "ms");
+    bench_row(out, "print raw", baseline.print_time, print_time, "ms");
+
+    const auto asset = baseline.index->FindAsset(guid);
+    const auto shared_asset = asset ? shared->Get(XmlSharedTree::GetPath(asset)) : nullptr;
+    if (shared_asset) {
+        pugi::xml_document copy;
+        std::ostringstream pugi_asset;
+        std::ostringstream shared_asset_xml;
+        asset.print(pugi_asset, "", pugi::format_raw);
+        shared->CopyTo(shared_asset, copy).print(shared_asset_xml, "", pugi::format_raw);
+        out << fmt::format("GUID {}: {}", guid, pugi_asset.str() == shared_asset_xml.str() ? "same" : "different")
+            << std::endl;
+    }
+}
+
+int command_bench(const XmltestParameters& params, std::ostream& out) {
+    // counts pugixml memory, the document itself is read into an arena
+    XmlArena::Install();
+    XmlMemory::CountBlocks(true);
+    // memory still held, without chunks kept for the next document like those of parsing threads
+    const auto resident = []() {
+        return XmlMemory::GetTotal().current - XmlArena::GetStats().recycled_bytes;
+    };
+
+    std::shared_ptr<pugi::xml_document> doc;
+    const auto resident_before = resident();
+    const auto load_time = bench_time([&]() { doc = XmlAutoSerializer::read(params.targetPath); });
+    bench_row(out, "memory", (resident() - resident_before) / 1048576.0, "MB");
+
+    const auto baseline = bench_pugixml(doc, load_time, out);
+    bench_arena(doc, out);
+    bench_parallel_print(doc, baseline, out);
+    bench_shared_tree(doc, baseline, params.guid, out);
+    return 0;
+}
+
 std::shared_ptr<pugi::xml_document> _get_prepatched(const XmltestParameters& params, bool hide = false) {
     // disable debug as we don't want that for prepatch files
     spdlog::set_level(hide ? spdlog::level::critical : spdlog::level::info);
+    XmlMemory::Scope memory{XmlMemory::Stage::Parse, params.targetPath.generic_string()};
     auto doc = xmlops::XmlAutoSerializer::read(params.targetPath);
     auto patch_game_path = fs::relative(params.patchPath, params.modPaths.front());
     for (auto dep : params.prepatchPaths) {
@@ -85,8 +246,6 @@ std::shared_ptr<pugi::xml_document> _patch(std::shared_ptr<pugi::xml_document> d
     const auto mod_name = "xmltest";
 
     auto loader = [&mod_path, &mod_name, &patch_content, &game_path, &params](const fs::path& file_path) {
-        std::vector<char> buffer;
-        size_t size;
         spdlog::debug("Include: {}", file_path.string());
 
         // handle additional paths
@@ -103,11 +262,12 @@ std::shared_ptr<pugi::xml_document> _patch(std::shared_ptr<pugi::xml_document> d
         }
 
         // read found (or just mod_path)
-        if (!XmlOperationContext::ReadFile(search_path / file_path, buffer, size)) {
+        auto include = XmlOperationContext::LoadInclude(search_path / file_path, file_path, mod_name);
+        if (!include) {
             spdlog::error("{}: Failed to open {}", mod_name, file_path.string());
             return std::make_shared<XmlOperationContext>();
         }
-        return std::make_shared<XmlOperationContext>(buffer.data(), size, file_path, mod_name);
+        return include;
     };
     auto context = (params.useStdin && path_equal(game_path, params.stdinPath)) ?
         std::make_shared<XmlOperationContext>(patch_content.data(), patch_content.size(), game_path, mod_name, loader) :
@@ -116,15 +276,15 @@ std::shared_ptr<pugi::xml_document> _patch(std::shared_ptr<pugi::xml_document> d
 
     auto start = std::chrono::high_resolution_clock::now();
     auto operations = XmlOperation::GetXmlOperations(context, game_path);
-    for (auto& operation : operations) {
-        operation.Apply(doc);
-    }
+    XmlOperation::ApplyAll(operations, doc);
 
     XmlAutoSerializer::fix(doc.get(), params.patchPath.stem());
 
     auto end = std::chrono::high_resolution_clock::now();
     auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
     spdlog::debug("Time: {}ms {} ({}:{})", duration, "Group", context->GetGenericPath(), 0);
+    const auto include_cache = XmlOperationContext::GetIncludeCacheStats();
+    spdlog::debug("Include cache: {} hits, {} misses", include_cache.hits, include_cache.misses);
     std::cout << fmt::format("ModOp time: {:.3f}s", duration / 1000.0f) << std::endl;
     return doc;
 }
@@ -179,6 +339,7 @@ int command_patch(const XmltestParameters& params, const std::string& patch_cont
     doc = _patch(doc, params, patch_content);
 
     if (!params.skipOutput) {
+        XmlMemory::Scope memory{XmlMemory::Stage::Serialize, params.outputFile.generic_string()};
         if (!XmlAutoSerializer::write(doc.get(), params.outputFile, true)) {
             printf("Could not open file for writing\n");
         }
@@ -202,16 +363,27 @@ int main(int argc, const char **argv)
     }
 
     spdlog::set_level(params.verbose ? spdlog::level::debug : spdlog::level::info);
+    if (params.verbose) {
+        // pugixml allocations are only counted through the arena hooks
+        XmlArena::Install();
+        XmlMemory::CountBlocks(true);
+    }
 
+    int result = 0;
+    XmlOperationContext::IncludeCachePass include_cache_pass;
     if (params.command == XmltestParameters::Command::Show) {
-        return command_show(params, std::cout);
+        result = command_show(params, std::cout);
+    }
+    else if (params.command == XmltestParameters::Command::Bench) {
+        result = command_bench(params, std::cout);
     }
     else if (params.command == XmltestParameters::Command::Diff) {
-        return command_diff(params, patch_content, std::cout);
+        result = command_diff(params, patch_content, std::cout);
     }
     else {
-        return command_patch(params, patch_content);
+        result = command_patch(params, patch_content);
     }
 
-    return 0;
+    XmlMemory::LogStats();
+    return result;
 }
@@ -12,19 +12,22 @@ static void printUsage(FILE* out)
 {
     fprintf(out, "xmltest using modloader %s\n", MODLOADER_VERSION);
 
-    fprintf(out, "\nUsage: xmltest.exe [options] target-xml patch-xml|GUID\n\n");
+    fprintf(out, "\nUsage: xmltest.exe [options] target-xml [patch-xml|GUID]\n\n");
     fprintf(out, "-c=<command>  patch (default): output target-xml with patch-xml applied.\n");
     fprintf(out, "              show: output asset with GUID from target-xml.\n");
     fprintf(out, "              diff: output assets before and after patching.\n");
+    fprintf(out, "              bench: measure memory and speed of target-xml with pugixml, arenas,\n");
+    fprintf(out, "              parallel printing and a shared tree. Needs no patch-xml.\n");
     fprintf(out, "\n");
     fprintf(out, "-p=<path>     Apply mods before testing patch-xml.\n");
     fprintf(out, "              Multiple are allowed.\n");
     fprintf(out, "-m=<path>     Specify mod path. Default: working directory\n");
     fprintf(out, "              Multiple are allowed.\n");
     fprintf(out, "-i=<relpath>  Read patch content from stdin. File is needed for relative path to mod.\n");
+    fprintf(out, "-g=<GUID>     Asset to show, or to compare between documents with bench.\n");
     fprintf(out, "-o            Output file. Default: patched.{xml,fc,cfg,bin}\n");
     fprintf(out, "-s            Skip output.\n");
-    fprintf(out, "-v            Verbose.\n");
+    fprintf(out, "-v            Verbose, with memory usage by stage and file.\n");
 }
 
 static bool invalidUsage(const std::string& pArg)
@@ -88,6 +91,13 @@ bool parseArguments(int argc, const char* argv[], XmltestParameters& params)
                     lastMode = 'o';
                     break;
                 }
+                case 'g': {
+                    if (!params.guid.empty()) {
+                        return invalidUsage(pArg);
+                    }
+                    lastMode = 'g';
+                    break;
+                }
                 case 'c':
                 case 'p':
                 case 'm': {
@@ -111,6 +121,9 @@ bool parseArguments(int argc, const char* argv[], XmltestParameters& params)
                     else if (std::string(pArg) == "show") {
                         params.command = XmltestParameters::Command::Show;
                     }
+                    else if (std::string(pArg) == "bench") {
+                        params.command = XmltestParameters::Command::Bench;
+                    }
                     else {
                         return invalidUsage(pArg);
                     }
@@ -132,6 +145,10 @@ bool parseArguments(int argc, const char* argv[], XmltestParameters& params)
                     params.stdinPath = pArg;
                     break;
                 }
+                case 'g': {
+                    params.guid = pArg;
+                    break;
+                }
                 default: {
                     return invalidUsage(pArg);
                 }
@@ -156,7 +173,17 @@ bool parseArguments(int argc, const char* argv[], XmltestParameters& params)
         return false;
     }
 
-    if (params.patchPath.empty()) {
+    // show takes the GUID in place of the patch file too
+    if (params.command == XmltestParameters::Command::Show && params.guid.empty()) {
+        params.guid = params.patchPath.string();
+    }
+    if (params.command == XmltestParameters::Command::Show && params.guid.empty()) {
+        fprintf(stderr, "Specify target file and GUID.\n");
+        printUsage(stderr);
+        return false;
+    }
+    if (params.patchPath.empty() && params.command != XmltestParameters::Command::Show &&
+        params.command != XmltestParameters::Command::Bench) {
         fprintf(stderr, "Specify target and patch file.\n");
         printUsage(stderr);
         return false;
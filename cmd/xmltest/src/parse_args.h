@@ -2,13 +2,15 @@
 #pragma once
 
 #include <filesystem>
+#include <string>
 #include <vector>
 
 struct XmltestParameters {
     enum class Command {
         Patch,
         Diff,
-        Show
+        Show,
+        Bench
     };
 
     Command command;
@@ -17,6 +19,7 @@ struct XmltestParameters {
     std::filesystem::path targetPath;
     std::filesystem::path patchPath;
     std::filesystem::path outputFile;
+    std::string guid;
     std::vector<std::filesystem::path> modPaths;
     std::vector<std::filesystem::path> prepatchPaths;
 
@@ -13,11 +13,14 @@ class Mod
     explicit Mod(const fs::path &root);
 
     std::string Name() const;
+    /// @brief ModID from modinfo.json, the folder name without one.
+    std::string Id() const;
     bool        HasFile(const fs::path &file) const;
     void        ForEachFile(std::function<void(const fs::path &, const fs::path &)>) const;
     fs::path    Path() const;
 
   private:
     fs::path                               root_path;
+    std::string                            id;
     PathMap<fs::path> file_mappings;
 };
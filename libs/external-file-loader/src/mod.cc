@@ -1,5 +1,9 @@
 #include "mod.h"
 
+#include "nlohmann/json.hpp"
+
+#include <fstream>
+
 Mod::Mod(const fs::path& root)
     : root_path(root)
 {
@@ -15,6 +19,23 @@ Mod::Mod(const fs::path& root)
             }
         }
     }
+
+    id = Name();
+    std::ifstream ifs(root_path / "modinfo.json");
+    if (ifs) {
+        try {
+            const auto& data = nlohmann::json::parse(ifs);
+            if (data.contains("ModID") && data["ModID"].is_string() && !data["ModID"].get<std::string>().empty()) {
+                id = data["ModID"].get<std::string>();
+            }
+        } catch (const nlohmann::json::exception&) {
+        }
+    }
+}
+
+std::string Mod::Id() const
+{
+    return id;
 }
 
 std::string Mod::Name() const
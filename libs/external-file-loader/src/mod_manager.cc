@@ -3,10 +3,14 @@
 #include "meow_hash_x64_aesni.h"
 
 #include "anno/random_game_functions.h"
+#include "xml_arena.h"
+#include "xml_lazy_document.h"
+#include "xml_memory.h"
 #include "xml_operations.h"
 using namespace xmlops;
 
 #include "absl/strings/str_cat.h"
+#include "absl/strings/str_join.h"
 #include "spdlog/spdlog.h"
 
 #define ZSTD_STATIC_LINKING_ONLY /* ZSTD_compressContinue, ZSTD_compressBlock */
@@ -378,12 +382,15 @@ ModManager::LayerId ModManager::PushCacheLayer(const fs::path&    game_path,
     size_t const                    cBuffSize = ZSTD_compressBound(buf.size());
     static thread_local std::string CompressedBuffer;
     CompressedBuffer.resize(cBuffSize);
-    size_t const cSize =
-        ZSTD_compress(CompressedBuffer.data(), CompressedBuffer.size(), buf.data(), buf.size(), 1);
-    CompressedBuffer.resize(cSize);
+    {
+        XmlMemory::Usage memory{XmlMemory::Stage::Compress, game_path.string(), CompressedBuffer.capacity()};
+        size_t const     cSize =
+            ZSTD_compress(CompressedBuffer.data(), CompressedBuffer.size(), buf.data(), buf.size(), 1);
+        CompressedBuffer.resize(cSize);
 
-    ofs.write(CompressedBuffer.data(), CompressedBuffer.size());
-    ofs.close();
+        ofs.write(CompressedBuffer.data(), CompressedBuffer.size());
+        ofs.close();
+    }
 
     cache.push_back(layer);
 
@@ -420,14 +427,26 @@ void ModManager::GameFilesReady()
 
     ModManager::EnsureDummy();
 
+    // game files are parsed into arenas, released at once after each file
+    XmlArena::Install();
+
     patching_file_thread_ = std::thread([this]() {
         spdlog::info("Start applying xml operations");
 
         const auto cache_directory = ModManager::GetCacheDirectory();
+        // includes are parsed once for all files patched here, and released once this thread is done
+        XmlOperationContext::IncludeCachePass include_cache_pass;
 
         CollectPatchableFiles();
         ReadCache();
 
+        // #ModId conditions are decided by the mods loaded now, so are the cached outputs
+        std::set<std::string> mod_ids;
+        for (const auto& mod : mods_) {
+            mod_ids.insert(mod.Id());
+        }
+        const auto mod_ids_hash = GetDataHash(absl::StrJoin(mod_ids, ";"));
+
         for (auto&& modded_file : modded_patchable_files_) {
             if (shuttding_down_.load()) {
                 return;
@@ -448,6 +467,10 @@ void ModManager::GameFilesReady()
                 }
                 continue;
             }
+            const auto game_name = game_path.string();
+            // declared before the document, so it's counted until the document is gone
+            XmlMemory::Usage read_memory{XmlMemory::Stage::Read, game_name, game_file.size()};
+
             std::shared_ptr<pugi::xml_document> game_xml         = nullptr;
             auto                                game_file_hash   = GetDataHash(game_file);
             LayerId                             last_valid_cache = {"", ""};
@@ -457,7 +480,7 @@ void ModManager::GameFilesReady()
                 if (shuttding_down_.load()) {
                     return;
                 }
-                auto       patch_file_hash = GetFileHash(on_disk_file);
+                auto       patch_file_hash = GetDataHash(GetFileHash(on_disk_file) + mod_ids_hash);
                 const auto output_hash =
                     CheckCacheLayer(game_path, next_input_hash, patch_file_hash);
                 if (output_hash) {
@@ -475,9 +498,13 @@ void ModManager::GameFilesReady()
                         } else {
                             cache_data = ReadCacheLayer(game_path, last_valid_cache.output);
                         }
-                        game_xml = std::make_shared<pugi::xml_document>();
-                        auto parse_result =
-                            game_xml->load_buffer(cache_data.data(), cache_data.size());
+                        // assets are only parsed once an op reaches them, the content is kept for the others
+                        read_memory.Add(cache_data.size());
+                        pugi::xml_parse_result parse_result;
+                        {
+                            XmlMemory::Scope memory{XmlMemory::Stage::Parse, game_name};
+                            game_xml = XmlLazyDocument::Load(std::move(cache_data), parse_result);
+                        }
                         if (!parse_result) {
                             spdlog::error("Failed to parse cache {}: {}", on_disk_file.string(),
                                           parse_result.description());
@@ -488,10 +515,10 @@ void ModManager::GameFilesReady()
 
                     // Cache miss
                     auto& mod        = GetModContainingFile(on_disk_file);
-                    auto  operations = XmlOperation::GetXmlOperationsFromFile(
-                         on_disk_file, mod.Name(), game_path, mod.Path());
-                    for (auto&& operation : operations) {
-                        operation.Apply(game_xml);
+                    {
+                        XmlMemory::Scope memory{XmlMemory::Stage::Apply, game_name};
+                        XmlOperation::ApplyFile(game_xml, on_disk_file, mod.Name(), game_path, mod.Path(),
+                                                mod_ids);
                     }
 
                     struct xml_string_writer : pugi::xml_writer {
@@ -506,8 +533,9 @@ void ModManager::GameFilesReady()
                     spdlog::debug("Write XML output");
                     xml_string_writer writer;
                     writer.result.reserve(100 * 1024 * 1024);
-                    game_xml->print(writer, "", pugi::format_raw);
+                    XmlLazyDocument::Print(game_xml, writer);
                     std::string& buf = writer.result;
+                    XmlMemory::Usage serialize_memory{XmlMemory::Stage::Serialize, game_name, buf.capacity()};
                     spdlog::debug("Write XML output...Finished");
 
                     if (last_valid_cache.output.empty()) {
@@ -526,6 +554,10 @@ void ModManager::GameFilesReady()
 
             WriteCacheInfo(game_path);
 
+            if (auto lazy = XmlLazyDocument::Get(game_xml)) {
+                const auto stats = lazy->GetStats();
+                spdlog::debug("Parsed {} of {} assets of {}", stats.materialized, stats.assets, game_name);
+            }
             game_xml = nullptr;
         }
 
@@ -536,6 +568,13 @@ void ModManager::GameFilesReady()
             mods_ready_.store(true);
         }
         spdlog::info("Finished applying xml operations");
+        const auto include_cache = XmlOperationContext::GetIncludeCacheStats();
+        spdlog::debug("Include cache: {} hits, {} misses", include_cache.hits, include_cache.misses);
+        const auto arena = XmlArena::GetStats();
+        spdlog::debug("XML arenas: {} allocations, {} MB reserved, {} MB freed in place, {} created, {} recycled",
+                      arena.arena_allocations, arena.reserved_bytes >> 20, arena.arena_freed_bytes >> 20,
+                      arena.arenas_created, arena.arenas_recycled);
+        XmlMemory::LogStats();
 
         mods_ready_cv_.notify_all();
 
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "pugixml.hpp"
+
+#include <deque>
+#include <memory>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace xmlops {
+
+/// @brief Keyed elements like assets an op looked at or changed.
+struct XmlAccessSet
+{
+    /// @brief XmlIndex rule and key, e.g. {ASSET_RULE, "1500001"}.
+    std::set<std::pair<size_t, std::string>> keys;
+    /// @brief Reads: anything outside of keys, like a path searching the whole document.
+    ///        Writes: something outside of keyed elements.
+    bool all = false;
+
+    bool empty() const { return !all && keys.empty(); }
+    void Add(size_t rule, std::string key) { keys.emplace(rule, std::move(key)); }
+    void Merge(const XmlAccessSet& other);
+    /// @brief Reads of this set may see the writes.
+    bool Intersects(const XmlAccessSet& writes) const;
+};
+
+/// @brief What XmlOperation::Apply read and wrote per applied op, in the order they were applied.
+///        After a patch changed, only ops reading what changed have to be looked at again,
+///        see GetAffected.
+class XmlAccessLog
+{
+public:
+    struct Entry {
+        std::string  file;
+        size_t       line = 0;
+        /// @brief GUID of ops with multiple GUIDs.
+        std::string  guid;
+        /// @brief Condition, Content and Path lookups.
+        XmlAccessSet reads;
+        XmlAccessSet writes;
+    };
+
+    explicit XmlAccessLog(std::weak_ptr<pugi::xml_document> doc);
+
+    /// @brief Record accesses to doc from now on.
+    static std::shared_ptr<XmlAccessLog> Start(const std::shared_ptr<pugi::xml_document>& doc);
+    /// @returns nullptr if accesses to doc are not recorded.
+    static std::shared_ptr<XmlAccessLog> Get(const std::shared_ptr<pugi::xml_document>& doc);
+    /// @brief Stop recording and drop the log.
+    static void Stop(const std::shared_ptr<pugi::xml_document>& doc);
+
+    /// @brief Entry of an op about to be applied. Stays valid while more are added, e.g. for ops of a group.
+    Entry& Add(std::string file, size_t line, std::string guid);
+    /// @brief Record a change of node. Call before it is removed or changed, and after it has been inserted.
+    void Wrote(Entry& entry, pugi::xml_node node);
+
+    const std::deque<Entry>& GetEntries() const { return entries_; }
+    void Clear() { entries_.clear(); }
+
+    /// @brief Entries which may behave differently if changed has been modified before them.
+    ///        Writes of affected entries count as changed for the ones after them.
+    /// @param changed e.g. writes of a modified op, before and after the modification.
+    std::vector<size_t> GetAffected(XmlAccessSet changed, size_t first = 0) const;
+
+private:
+    std::weak_ptr<pugi::xml_document> doc_;
+    std::deque<Entry> entries_;
+};
+
+}
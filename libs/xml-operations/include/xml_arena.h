@@ -0,0 +1,115 @@
+#pragma once
+
+#include "pugixml.hpp"
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+namespace xmlops {
+
+/// @brief Bump allocator for the pages and strings of a pugixml document.
+///        Freeing a block is a no-op, everything is released at once together with the document.
+///        pugixml frees a page once all nodes on it are removed, those stay until then as well,
+///        see Stats::arena_freed_bytes.
+///        Released arenas keep some of their memory for the next document.
+///        Chunks are aligned to and marked in 64 KB granules, so frees of other blocks find out they
+///        are not from an arena without locking.
+class XmlArena
+{
+public:
+    struct Stats {
+        size_t arena_allocations = 0;
+        size_t arena_bytes       = 0;
+        /// @brief Blocks freed by pugixml inside arenas, e.g. pages of removed nodes.
+        ///        Their memory is only reused once the document is destroyed.
+        size_t arena_frees       = 0;
+        size_t arena_freed_bytes = 0;
+        /// @brief Blocks outside of arenas, same as pugixml would allocate without them.
+        size_t heap_allocations = 0;
+        size_t heap_bytes       = 0;
+        size_t heap_frees       = 0;
+        /// @brief Chunks held by arenas, including recycled ones.
+        size_t reserved_bytes   = 0;
+        /// @brief Part of reserved_bytes kept by released arenas for the next document.
+        size_t recycled_bytes   = 0;
+        size_t huge_page_chunks = 0;
+        size_t arenas_created   = 0;
+        size_t arenas_recycled  = 0;
+        /// @brief Arenas of documents still alive.
+        size_t arenas_in_use    = 0;
+    };
+
+    /// @brief Chunks start small for small documents like ModOp files and double up to CHUNK_SIZE.
+    static constexpr size_t MIN_CHUNK_SIZE = 64 << 10;
+    static constexpr size_t CHUNK_SIZE     = 4 << 20;
+    /// @brief Released arenas kept for the next document, and how much each of them keeps.
+    static constexpr size_t MAX_RECYCLED       = 4;
+    static constexpr size_t MAX_RECYCLED_BYTES = 4 * CHUNK_SIZE;
+
+    /// @brief Route pugixml allocations through arenas from now on.
+    ///        Blocks allocated before still go back to free(), so this can be called at any time.
+    /// @param huge_pages Back chunks with large pages if the system allows.
+    static void Install(bool huge_pages = false);
+    /// @brief Make plain documents again. The allocation functions from before Install are restored
+    ///        once no document with an arena is left, until then the hooks stay and use the heap.
+    ///        Nothing else may use pugixml meanwhile.
+    /// @returns false if the hooks had to stay.
+    static bool Uninstall();
+    static bool IsInstalled();
+
+    /// @brief Document with its own arena. A plain document if arenas are not installed.
+    ///        Its index, journal, access log and lazy state are dropped when it's destroyed.
+    static std::shared_ptr<pugi::xml_document> MakeDocument();
+
+    /// @brief Allocations of this thread go to the arena of doc while in scope.
+    ///        Only wrap code allocating for doc alone, usually parsing or copying into it.
+    class Scope
+    {
+    public:
+        explicit Scope(const std::shared_ptr<pugi::xml_document>& doc);
+        ~Scope();
+        Scope(const Scope&)            = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        XmlArena* previous_;
+    };
+
+    /// @brief Block counts are kept per thread and summed up here.
+    static Stats GetStats();
+
+    ~XmlArena();
+
+private:
+    struct Chunk {
+        char*  data;
+        size_t size;
+        bool   huge;
+    };
+    struct Deleter {
+        XmlArena* arena;
+        void      operator()(pugi::xml_document* doc) const;
+    };
+
+    std::vector<Chunk> chunks_;
+    /// @brief Chunk being filled and the bytes used in it.
+    size_t current_ = 0;
+    size_t used_    = 0;
+
+    XmlArena() = default;
+
+    void* Allocate(size_t size);
+    /// @brief Make all memory available again, keeping at most keep bytes of chunks.
+    void  Reset(size_t keep);
+
+    static Chunk AllocateChunk(size_t size);
+    static void  FreeChunk(const Chunk& chunk);
+    /// @brief Give the memory of chunk back to the system, without any bookkeeping.
+    static void  Release(const Chunk& chunk);
+
+    static void* AllocateHook(size_t size);
+    static void  DeallocateHook(void* ptr);
+};
+
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include "pugixml.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace xmlops {
+
+/// @brief Elements that can be looked up by a key, like Asset by GUID.
+struct XmlIndexRule
+{
+    enum KeyType { STRING, NUMBER };
+
+    /// @brief Keyed element, e.g. Asset.
+    std::string element;
+    /// @brief Child path to the key, e.g. Values/Standard/GUID.
+    std::string key_path;
+    /// @brief NUMBER keys only match paths comparing against digits.
+    KeyType key_type = STRING;
+};
+
+/// @brief Lookup state of a game document: keyed elements like Asset by GUID, value indices and
+///        memoized path results. Built once per document and kept up to date by XmlOperation::Apply.
+class XmlIndex
+{
+public:
+    using rules_t = std::vector<XmlIndexRule>;
+
+    static constexpr size_t ASSET_RULE    = 0;
+    static constexpr size_t TEMPLATE_RULE = 1;
+
+    explicit XmlIndex(pugi::xml_node root);
+
+    /// @brief Get index of a document.
+    /// @param build Build index if the document doesn't have one yet.
+    static std::shared_ptr<XmlIndex> Get(const std::shared_ptr<pugi::xml_document>& doc,
+                                         bool build = true);
+
+    /// @brief Register keyed elements of another file family.
+    ///        Only indices built afterwards are affected.
+    static void AddRule(XmlIndexRule rule);
+    static std::shared_ptr<const rules_t> GetRules();
+
+    /// @brief First keyed element with key in document order.
+    pugi::xml_node Find(size_t rule, const std::string& key) const;
+    /// @brief Number of keyed elements with key.
+    size_t         Count(size_t rule, const std::string& key) const;
+    pugi::xml_node FindAsset(const std::string& guid) const { return Find(ASSET_RULE, guid); }
+    pugi::xml_node FindTemplate(const std::string& name) const { return Find(TEMPLATE_RULE, name); }
+    /// @brief Rule and key of a keyed element.
+    /// @returns false if node is not one, or has no key.
+    bool GetKey(pugi::xml_node node, size_t& rule, std::string& key) const;
+
+    /// @brief Lookups of the same shape needed before a value index is built.
+    static constexpr size_t VALUE_INDEX_THRESHOLD = 3;
+
+    /// @brief Elements with a child path of a value, e.g. Item with Product 120008. In no particular order.
+    ///        The index for a shape is only built once it has been asked for often enough.
+    /// @param child_path e.g. Product or Building/AssociatedRegions
+    /// @returns false if there's no index for this shape yet.
+    bool FindByValue(const std::string& element, const std::string& child_path,
+                     const std::string& value, std::vector<pugi::xml_node>& results);
+
+    /// @brief Add node and its subtree. Call after node has been inserted.
+    void Insert(pugi::xml_node node);
+    /// @brief Drop node and its subtree. Call before node is removed.
+    void Remove(pugi::xml_node node);
+    /// @brief Re-read keys of node and its ancestors. Call after node has changed.
+    void Update(pugi::xml_node node);
+    /// @brief Invalidate memos of node and its ancestors. Done by Insert, Remove and Update.
+    void Touch(pugi::xml_node node);
+
+    /// @brief Result of path evaluated on root, if nothing in the subtree of root changed since.
+    const pugi::xpath_node_set* GetMemo(pugi::xml_node root, const std::string& path) const;
+    void SetMemo(pugi::xml_node root, const std::string& path, const pugi::xpath_node_set& results);
+
+private:
+    static constexpr size_t NONE = static_cast<size_t>(-1);
+
+    using map_t = std::unordered_multimap<std::string, pugi::xml_node>;
+    struct Entry {
+        size_t      rule;
+        std::string key;
+    };
+
+    struct ValueIndex {
+        std::string                                                           element;
+        std::vector<std::string>                                              child_steps;
+        size_t                                                                uses  = 0;
+        bool                                                                  built = false;
+        map_t                                                                 map;
+        std::unordered_map<pugi::xml_node_struct*, std::vector<std::string>> entries;
+    };
+
+    struct Memo {
+        uint64_t             generation;
+        pugi::xpath_node_set results;
+    };
+    struct MemoRoot {
+        /// @brief Generation of the last change within the subtree.
+        uint64_t                                changed = 0;
+        std::unordered_map<std::string, Memo> memos;
+    };
+
+    pugi::xml_node                                    root_;
+    std::shared_ptr<const rules_t>                    rules_;
+    std::vector<std::vector<std::string>>             key_steps_;
+    std::vector<map_t>                                maps_;
+    std::unordered_map<pugi::xml_node_struct*, Entry> entries_;
+    /// @brief Value indices by element[child_path], including the ones not built yet.
+    std::unordered_map<std::string, ValueIndex>       value_indices_;
+    std::vector<ValueIndex*>                          built_value_indices_;
+    uint64_t                                          generation_ = 0;
+    std::unordered_map<pugi::xml_node_struct*, MemoRoot> memo_roots_;
+
+    size_t         GetRule(pugi::xml_node node) const;
+    pugi::xml_node GetKeyNode(pugi::xml_node node, size_t rule) const;
+    void           Add(pugi::xml_node node, size_t rule);
+    void           Erase(pugi::xml_node node);
+    void           Walk(pugi::xml_node node, bool insert);
+
+    static void AddValues(ValueIndex& index, pugi::xml_node node);
+    static void EraseValues(ValueIndex& index, pugi::xml_node node);
+    /// @brief Add or erase values of node and all its descendants.
+    void        DropMemos(pugi::xml_node node);
+    static void WalkValues(pugi::xml_node node, bool insert, const std::vector<ValueIndex*>& indices);
+};
+
+}
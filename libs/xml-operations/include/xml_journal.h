@@ -0,0 +1,61 @@
+#pragma once
+
+#include "pugixml.hpp"
+
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace xmlops {
+
+/// @brief Undo log of the changes XmlOperation::Apply makes to a game document.
+///        Rolling back to a mark restores the document as it was, e.g. before a mod was applied,
+///        without reading and parsing it again.
+class XmlJournal
+{
+public:
+    explicit XmlJournal(std::weak_ptr<pugi::xml_document> doc);
+
+    /// @brief Record changes to doc from now on.
+    static std::shared_ptr<XmlJournal> Start(const std::shared_ptr<pugi::xml_document>& doc);
+    /// @returns nullptr if changes to doc are not recorded.
+    static std::shared_ptr<XmlJournal> Get(const std::shared_ptr<pugi::xml_document>& doc);
+    /// @brief Stop recording and drop the log.
+    static void Stop(const std::shared_ptr<pugi::xml_document>& doc);
+
+    /// @brief Current position, e.g. to roll back to before the next mod.
+    size_t Mark() const { return entries_.size(); }
+    /// @brief Undo all changes made after mark, newest first.
+    void Rollback(size_t mark);
+
+    void Inserted(pugi::xml_node node);
+    /// @brief Call before node is removed.
+    void Removing(pugi::xml_node node);
+    /// @brief Call before the value or attributes of node change. Children are not saved.
+    void Changing(pugi::xml_node node);
+
+private:
+    enum Type { Insert, Remove, Change };
+
+    struct Entry {
+        Type type;
+        /// @brief Parent of a removed node, the node itself otherwise.
+        pugi::xml_node node;
+        /// @brief Sibling before a removed node.
+        pugi::xml_node previous;
+        /// @brief Copy of a removed node, or of a changed node without children.
+        pugi::xml_node saved;
+        /// @brief Nodes of a removed subtree in document order, to find their restored copies.
+        std::vector<const void*> removed;
+    };
+
+    std::weak_ptr<pugi::xml_document> doc_;
+    std::vector<Entry> entries_;
+    pugi::xml_document saved_;
+    /// @brief Restored copies of removed nodes. Older entries still refer to the originals.
+    std::unordered_map<const void*, pugi::xml_node> restored_;
+
+    pugi::xml_node Resolve(pugi::xml_node node) const;
+};
+
+}
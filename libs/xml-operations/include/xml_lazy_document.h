@@ -0,0 +1,84 @@
+#pragma once
+
+#include "pugixml.hpp"
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace xmlops {
+
+struct XmlAccessSet;
+class XmlIndex;
+
+/// @brief Game document with its assets parsed only once an op reaches them.
+///        Loading scans the content for assets and their GUIDs and parses the rest with an empty
+///        placeholder for each. XmlOperation::Apply parses the assets an op reads before applying it,
+///        or all of them for ops that may read anything. Print parses the others one at a time
+///        and prints them like the rest, without keeping them.
+///        Not meant for documents with an XmlJournal, rolling back may restore placeholders.
+class XmlLazyDocument
+{
+public:
+    struct Stats {
+        size_t assets       = 0;
+        size_t materialized = 0;
+    };
+
+    explicit XmlLazyDocument(std::weak_ptr<pugi::xml_document> doc);
+
+    /// @brief Parse content with assets left out. Documents without assets are parsed as usual.
+    ///        Keeps content for the assets and the skeleton with placeholders the document is parsed
+    ///        from in place, about the content plus the bytes outside of assets at the peak.
+    static std::shared_ptr<pugi::xml_document> Load(std::string content, pugi::xml_parse_result& result);
+    /// @returns nullptr if doc has not been loaded lazily.
+    static std::shared_ptr<XmlLazyDocument> Get(const std::shared_ptr<pugi::xml_document>& doc);
+
+    /// @brief Path can be evaluated on the document without looking at any asset or its placeholder,
+    ///        e.g. /AssetList/Groups/Group/Assets to add to. Only paths of child steps by name qualify,
+    ///        predicates could look at the string value of containers with placeholders.
+    static bool Avoids(const std::string& path);
+
+    /// @brief Parse the assets with keys in reads, or all if reads may see anything.
+    ///        Keys that are neither pending nor in the document could be searched for anywhere,
+    ///        so they parse all as well.
+    void Materialize(const XmlAccessSet& reads);
+    void MaterializeAll();
+
+    /// @brief Unformatted XML of doc, the same as format_raw after parsing all assets.
+    ///        Pending assets are parsed one at a time into a scratch document for this.
+    static void Print(const std::shared_ptr<pugi::xml_document>& doc, pugi::xml_writer& writer);
+
+    Stats GetStats() const;
+
+private:
+    static constexpr const char* PLACEHOLDER_ATTRIBUTE = "xmlops-lazy";
+
+    struct Range {
+        size_t         begin;
+        size_t         end;
+        pugi::xml_node placeholder;
+        bool           pending = true;
+    };
+
+    std::weak_ptr<pugi::xml_document>                     doc_;
+    std::string                                           content_;
+    std::vector<Range>                                    ranges_;
+    /// @brief Ranges by GUID, in document order.
+    std::unordered_map<std::string, std::vector<size_t>>  keys_;
+    std::unordered_map<pugi::xml_node_struct*, size_t>   placeholders_;
+    size_t                                                pending_ = 0;
+
+    /// @brief Outermost assets with their keys, found without parsing.
+    void Scan();
+    void Materialize(const std::shared_ptr<pugi::xml_document>& doc, size_t range, XmlIndex* index);
+    /// @returns true if node has pending placeholders in its subtree, which are added to pending.
+    bool FindPending(pugi::xml_node node, std::unordered_map<pugi::xml_node_struct*, bool>& pending) const;
+    /// @param asset Scratch document for pending assets.
+    void Print(pugi::xml_node node, const std::unordered_map<pugi::xml_node_struct*, bool>& pending,
+               pugi::xml_document& asset, pugi::xml_writer& writer) const;
+};
+
+}
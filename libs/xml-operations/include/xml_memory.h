@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <string>
+
+namespace xmlops {
+
+/// @brief Current and peak bytes by stage of patching and by document or ModOp file.
+///        pugixml allocations are counted once XmlArena::Install() routed them through its hooks.
+///        Arena chunks count for whoever reserved them, even after they have been recycled.
+///        Blocks outside of arenas are only counted after CountBlocks(true), every one of them
+///        goes through a global lock then.
+class XmlMemory
+{
+public:
+    enum class Stage { None, Read, Parse, Apply, Serialize, Compress, Count };
+
+    struct Counter {
+        size_t current = 0;
+        size_t peak    = 0;
+        /// @brief All bytes ever counted.
+        size_t total = 0;
+    };
+
+    /// @brief Count pugixml allocations of this thread to stage and name while in scope.
+    class Scope
+    {
+    public:
+        /// @param name Document or ModOp file. Empty keeps the name of the outer scope.
+        explicit Scope(Stage stage, const std::string& name = {});
+        ~Scope();
+        Scope(const Scope&)            = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        Stage    previous_stage_;
+        Counter* previous_name_;
+    };
+
+    /// @brief Count memory outside of pugixml, like file contents and output buffers.
+    static void Add(Stage stage, const std::string& name, size_t bytes);
+    static void Remove(Stage stage, const std::string& name, size_t bytes);
+
+    /// @brief Add bytes while in scope, removed again however the scope is left.
+    class Usage
+    {
+    public:
+        Usage(Stage stage, std::string name, size_t bytes = 0);
+        ~Usage();
+        Usage(const Usage&)            = delete;
+        Usage& operator=(const Usage&) = delete;
+
+        /// @brief Count more bytes until the end of the scope.
+        void Add(size_t bytes);
+
+    private:
+        Stage       stage_;
+        std::string name_;
+        size_t      bytes_ = 0;
+    };
+
+    /// @brief Count pugixml blocks outside of arenas too. Blocks counted before turning it off
+    ///        stay counted.
+    static void CountBlocks(bool enable);
+    static bool IsCountingBlocks();
+
+    static Counter                        GetTotal();
+    static Counter                        GetStage(Stage stage);
+    static std::map<std::string, Counter> GetNamed();
+    static const char*                    GetStageName(Stage stage);
+
+    /// @brief Log stages and the names with the highest peaks at debug level.
+    static void LogStats(size_t names = 10);
+
+private:
+    friend class XmlArena;
+
+    static void Allocated(const void* block, size_t size);
+    static void Freed(const void* block);
+};
+
+}
@@ -2,21 +2,29 @@
 
 #include "pugixml.hpp"
 
+#include <chrono>
 #include <filesystem>
 #include <functional>
+#include <memory>
 #include <optional>
 #include <set>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 namespace fs = std::filesystem;
 
 namespace xmlops {
 
+struct XmlAccessSet;
+class XmlIndex;
+class XmlJournal;
+class XmlLineIndex;
+class XmlSimplePath;
+
 class XmlOperationContext
 {
 public:
-    using offset_data_t = std::vector<ptrdiff_t>;
     using include_loader_t = std::function<std::shared_ptr<XmlOperationContext>(const fs::path&)>;
 
     XmlOperationContext();
@@ -48,14 +56,58 @@ public:
 
     static bool ReadFile(const fs::path& file_path, std::vector<char>& buffer, size_t& size);
 
+    /// @brief Read and parse file_path.
+    /// @param doc_path Path used for messages.
+    /// @returns nullptr if the file can't be read.
+    static std::shared_ptr<XmlOperationContext> LoadFile(const fs::path& file_path,
+                                                         const fs::path& doc_path,
+                                                         const std::string& mod_name = {},
+                                                         std::optional<include_loader_t> include_loader = {});
+    /// @brief LoadFile for includes. While an IncludeCachePass is alive, the parsed document is reused
+    ///        if the same file was included before with the same content.
+    static std::shared_ptr<XmlOperationContext> LoadInclude(const fs::path& file_path,
+                                                            const fs::path& doc_path,
+                                                            const std::string& mod_name = {},
+                                                            std::optional<include_loader_t> include_loader = {});
+
+    /// @brief Includes are cached while at least one pass is alive, and released with the last one.
+    ///        Passes on other threads share the same cache.
+    class IncludeCachePass
+    {
+    public:
+        IncludeCachePass();
+        IncludeCachePass(const IncludeCachePass&)            = delete;
+        IncludeCachePass& operator=(const IncludeCachePass&) = delete;
+
+    private:
+        std::shared_ptr<void> cache_;
+    };
+
+    struct IncludeCacheStats {
+        size_t hits = 0;
+        size_t misses = 0;
+    };
+    static IncludeCacheStats GetIncludeCacheStats();
+
+    /// @brief Compile XPath. Queries are shared by all lookups of this file.
+    /// @param node ModOp for error messages.
+    /// @returns nullptr if the path is invalid.
+    std::shared_ptr<const pugi::xpath_query> CompileQuery(const std::string& path, pugi::xml_node node) const;
+
 private:
     std::string mod_name_;
     std::shared_ptr<pugi::xml_document> doc_;
-    offset_data_t offset_data_;
+    std::shared_ptr<const XmlLineIndex> lines_;
     std::optional<include_loader_t> include_loader_;
     std::string doc_path_;
 
-    static offset_data_t BuildOffsetData(const char* buffer, size_t size);
+    struct CompiledQuery {
+        std::shared_ptr<const pugi::xpath_query> query;
+        std::string error;
+    };
+    mutable std::unordered_map<std::string, CompiledQuery> queries_;
+
+    bool Parse(const std::vector<char>& content, std::shared_ptr<const XmlLineIndex> lines);
 };
 
 class XmlLookup
@@ -68,52 +120,95 @@ public:
               bool explicit_speculative,
               std::shared_ptr<XmlOperationContext> context,
               pugi::xml_node node);
+    XmlLookup(const XmlLookup&) = delete;
+    XmlLookup(XmlLookup&&) = default;
+    XmlLookup& operator=(const XmlLookup&) = delete;
+    XmlLookup& operator=(XmlLookup&&) = default;
 
     /// @brief Select XPath nodes.
+    ///        Index lookups without results fall back to XPath unless the index shows there is nothing to find.
     /// @param assetNode Start search here. Resulting asset is stored back.
-    /// @param strict Skip normal XPath selection if GUID or Template is specified.
+    /// @param guid Use this GUID instead of the one the lookup has been created with.
     pugi::xpath_node_set Select(std::shared_ptr<pugi::xml_document> doc,
         std::optional<pugi::xml_node>* assetNode = nullptr,
-        bool strict = false) const;
+        const std::string* guid = nullptr) const;
 
     bool IsEmpty() const { return empty_path_; };
     bool IsNegative() const { return negative_; };
     const std::string& GetPath() const { return path_; };
+    std::string GetPath(const std::string* guid) const;
     bool IsModId() const { return mod_id_; };
 
+    /// @brief Keyed element the results are confined to, like the asset of `GUID="1" Path="/Values/Cost"`.
+    /// @returns Empty node if results can be outside of a single keyed element, or if it doesn't exist.
+    pugi::xml_node FindScope(const XmlIndex& index, const std::string* guid = nullptr) const;
+    /// @brief Select below a node returned by FindScope.
+    ///        Nothing is memoized, so it can run concurrently as long as the document isn't modified.
+    pugi::xpath_node_set SelectInScope(pugi::xml_node scope) const;
+
+    /// @brief Keyed elements Select looks at, or all if the path can't be confined to keys.
+    /// @param found Select had results. Speculative paths look everywhere otherwise.
+    void GetReads(const std::string* guid, bool found, XmlAccessSet& reads) const;
+
 private:
     std::shared_ptr<XmlOperationContext> context_;
     pugi::xml_node node_;
 
-    bool empty_path_;
-    bool negative_;
+    bool empty_path_ = true;
+    bool negative_ = false;
     std::string path_;
-    std::string guid_;
-    std::string template_;
     bool mod_id_ = false;
-
-    enum SpeculativePathType {
-        NONE,
-        SINGLE_ASSET,
-        VALUES_CONTAINER,
-        ASSET_CONTAINER,
-        SINGLE_TEMPLATE,
-        TEMPLATE_CONTAINER,
+    /// @brief GUID attribute, branches_ starts with its lookup if guid_branch_ is set.
+    std::string guid_;
+    bool guid_branch_ = false;
+
+    std::shared_ptr<const pugi::xpath_query> query_;
+    /// @brief Native evaluation of simple paths, nullptr if the XPath VM is needed.
+    std::shared_ptr<const XmlSimplePath> simple_path_;
+
+    /// @brief Union branch of the path. Index lookup followed by a relative path if keys are set.
+    struct Branch {
+        std::string path;
+        std::shared_ptr<const pugi::xpath_query> query;
+        std::shared_ptr<const XmlSimplePath> simple_path;
+
+        size_t key_rule = 0;
+        /// @brief Keys of `[GUID='1' or GUID='2']`.
+        std::vector<std::string> keys;
+        /// @brief Keyed element and elements up to the predicate step, e.g. Asset for `Assets[Asset/GUID='1']`.
+        std::vector<std::string> up;
+        /// @brief Path down to the predicate step, e.g. Values for `Values[Standard/GUID='1']`.
+        std::string down;
+        /// @brief Predicate step followed by the steps before it, in reverse.
+        std::vector<std::string> ancestors;
+        bool absolute = false;
+        /// @brief Child path for a value index lookup instead of keyed elements, e.g. Product for `//Item[Product='1']`.
+        std::string value_path;
+        /// @brief Results only depend on the subtree they are evaluated on.
+        bool memoize = false;
     };
-
-    std::string speculative_path_;
-    SpeculativePathType speculative_path_type_ = SpeculativePathType::NONE;
+    /// @brief Empty if no branch can use index lookups.
+    std::vector<Branch> branches_;
+    /// @brief Keyed element lookups may miss nodes XPath would find.
+    bool fallback_ = false;
 
     void ReadPath(std::string prop_path, std::string guid, std::string templ);
-    std::optional<pugi::xml_node> FindAsset(const std::string& guid, pugi::xml_node node, int speculate_position = 2) const;
-    std::optional<pugi::xml_node> FindTemplate(const std::string& temp, pugi::xml_node node) const;
-    std::optional<pugi::xml_node> FindTemplate(std::shared_ptr<pugi::xml_document> doc, const std::string& templ) const;
-
-    /// @brief Select XPath nodes via Values/Standard/GUID.
-    /// @param assetNode Start search here. Resulting asset is stored back.
-    pugi::xpath_node_set ReadGuidNodes(std::shared_ptr<pugi::xml_document> doc, 
-        std::optional<pugi::xml_node>* assetNode) const;
-    pugi::xpath_node_set ReadTemplateNodes(std::shared_ptr<pugi::xml_document> doc) const;
+    void ReadBranches();
+    bool ReadKeyedBranch(const std::string& path, Branch& branch) const;
+    void Compile();
+    /// @param index Memoize results if set.
+    pugi::xpath_node_set Evaluate(XmlIndex* index, pugi::xml_node node, const std::string& path,
+        const pugi::xpath_query& query, const XmlSimplePath* simple_path) const;
+    pugi::xml_node FindKeyed(const XmlIndex& index, const Branch& branch, const std::string& key) const;
+
+    /// @brief Select union of all branches.
+    /// @param assetNode First keyed node found is stored back.
+    /// @param complete Set to false if XPath may find more. Keyed elements are only looked up
+    ///        by the first of them, and those nested into others aren't indexed, so results are
+    ///        only known to be complete if every key belongs to exactly one element of the branch.
+    /// @returns nullopt if a value index isn't available yet.
+    std::optional<pugi::xpath_node_set> SelectBranches(std::shared_ptr<pugi::xml_document> doc,
+        std::optional<pugi::xml_node>* assetNode, const std::string* guid, bool& complete) const;
 };
 
 class XmlOperation
@@ -123,23 +218,52 @@ public:
 
     XmlOperation(std::shared_ptr<XmlOperationContext> doc, pugi::xml_node node,
                  const std::string& guid = "", const std::string& templ = "");
+    XmlOperation(const XmlOperation&) = delete;
+    XmlOperation(XmlOperation&&) = default;
+    XmlOperation& operator=(const XmlOperation&) = delete;
+    XmlOperation& operator=(XmlOperation&&) = default;
 
     Type GetType() const;
 
-    void Apply(std::shared_ptr<pugi::xml_document> doc, const std::set<std::string>& mod_ids = {});
+    /// @brief Apply all operations in order.
+    ///        Lookups of consecutive ops confined to different assets are done in parallel,
+    ///        changes are still made one after another.
+    ///        Includes are read when they are applied first.
+    static void ApplyAll(std::vector<XmlOperation>& operations, std::shared_ptr<pugi::xml_document> doc,
+                         const std::set<std::string>& mod_ids = {});
+    /// @brief Look up batches on this many threads, regardless of their cost. 0 measures, as by default.
+    static void SetLookupThreads(size_t threads);
+    /// @brief Lookups handed over to workers so far.
+    static size_t GetParallelLookups();
 
 public:
+    /// @brief Read ops into a flat list. Groups are followed by their ops.
+    /// @param mod_ids Skip ops and groups with `#ModId` conditions not matching these, if set.
     static std::vector<XmlOperation> GetXmlOperations(
         std::shared_ptr<XmlOperationContext> doc,
         const fs::path&     game_path,
-        std::optional<pugi::xml_object_range<pugi::xml_node_iterator>> nodes = {});
+        std::optional<pugi::xml_object_range<pugi::xml_node_iterator>> nodes = {},
+        const std::set<std::string>* mod_ids = nullptr);
     static std::vector<XmlOperation> GetXmlOperationsFromFile(
         const fs::path&     file_path,
         std::string         mod_name,
         const fs::path&     game_path,
-        const fs::path&     mod_path);
+        const fs::path&     mod_path,
+        const std::set<std::string>* mod_ids = nullptr);
+    /// @brief Read the ops of a file without those excluded by mod_ids and apply them, like the mod manager.
+    static void ApplyFile(std::shared_ptr<pugi::xml_document> doc,
+        const fs::path&     file_path,
+        std::string         mod_name,
+        const fs::path&     game_path,
+        const fs::path&     mod_path,
+        const std::set<std::string>& mod_ids);
 
 private:
+    /// @brief Lookups of a batch timed before deciding if workers are worth waking up.
+    static constexpr size_t PARALLEL_LOOKUPS = 16;
+    /// @brief Lookup time left per worker, less doesn't pay for handing it over.
+    static constexpr std::chrono::microseconds PARALLEL_LOOKUP_TIME{200};
+
     Type        type_;
     XmlLookup   path_;
     bool        allow_no_match_ = false;
@@ -151,21 +275,54 @@ private:
     std::shared_ptr<XmlOperationContext> doc_;
     pugi::xml_node node_;
 
-    std::vector<XmlOperation> group_;
+    /// @brief Number of ops following a group which belong to it, nested ones included.
+    size_t group_size_ = 0;
+
+    struct Include {
+        fs::path path;
+        fs::path game_path;
+        /// @brief Empty until the include is applied first.
+        std::optional<std::vector<XmlOperation>> operations;
+    };
+    std::unique_ptr<Include> include_;
+    /// @brief All GUIDs of a batched op. Lookups are built for the first one.
+    std::vector<std::string> guids_;
+    /// @brief Child index paths of `<ModOpContent />` in the body, in document order.
+    std::vector<std::vector<size_t>> content_placeholders_;
 
     static std::string GetXmlPropString(pugi::xml_node node, const std::string& prop_name)
     {
         return node.attribute(prop_name.c_str()).as_string();
     }
-    void RecursiveMerge(pugi::xml_node game_node, pugi::xml_node patching_node);
+    /// @brief Apply ops of [begin, end), groups together with the ops following them.
+    static void ApplyAll(XmlOperation* begin, XmlOperation* end, std::shared_ptr<pugi::xml_document> doc,
+                         const std::set<std::string>& mod_ids);
+    /// @brief Apply to doc. Ops with multiple GUIDs are applied once per GUID, groups with their ops.
+    void Apply(std::shared_ptr<pugi::xml_document> doc, const std::set<std::string>& mod_ids);
+    /// @param resolved Results of the path lookup if already known.
+    void Apply(std::shared_ptr<pugi::xml_document> doc, const std::set<std::string>& mod_ids,
+               const std::string* guid, const pugi::xpath_node_set* resolved = nullptr);
+    /// @brief Parse the assets of a lazily loaded doc this op may read.
+    void Materialize(const std::shared_ptr<pugi::xml_document>& doc, const std::string* guid) const;
+    void RecursiveMerge(pugi::xml_node game_node, pugi::xml_node patching_node, XmlIndex* index,
+                        XmlJournal* journal);
+    void ReadContentPlaceholders();
+    /// @brief Append a copy of the body to target for each result, with the result in place of `<ModOpContent />`.
+    void ExpandContent(const pugi::xpath_node_set& results, pugi::xml_node target) const;
     void ReadType(pugi::xml_node node);
+    static void ReadOperations(std::vector<XmlOperation>& operations,
+                               std::shared_ptr<XmlOperationContext> doc,
+                               const fs::path& game_path,
+                               pugi::xml_object_range<pugi::xml_node_iterator> nodes,
+                               const std::set<std::string>* mod_ids);
+    std::vector<XmlOperation>& ReadInclude();
 
     /// @brief Check Condition XPath. Can use GUID attribute.
     //         True when nodes are found.
     //         Can be negated with `!`.
     /// @param assetNode Returns GUID asset if found.
     bool CheckCondition(std::shared_ptr<pugi::xml_document> doc, std::optional<pugi::xml_node>& assetNode,
-        const std::set<std::string>& mod_ids);
+        const std::set<std::string>& mod_ids, const std::string* guid);
 };
 
 }
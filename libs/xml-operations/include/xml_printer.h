@@ -0,0 +1,28 @@
+#pragma once
+
+#include "pugixml.hpp"
+
+#include <cstddef>
+
+namespace xmlops {
+
+/// @brief Prints documents like xml_node::print, with large subtrees split up between threads.
+///        Children of nodes without text children are grouped into runs of similar size, and every
+///        run is printed into a buffer of its own. pugixml prints the rest of the document with a marker
+///        element in place of each run, which is then replaced by the buffer of the run. Output is the
+///        same as printing the whole document, with any indent and flags.
+class XmlPrinter
+{
+public:
+    /// @param threads 0 to choose by hardware and number of nodes.
+    static void Print(const pugi::xml_document& doc, pugi::xml_writer& writer, const pugi::char_t* indent = "\t",
+                      unsigned int flags = pugi::format_default, size_t threads = 0);
+
+private:
+    /// @brief Nodes per thread, fewer aren't worth starting threads for.
+    static constexpr size_t PARALLEL_NODES = 16384;
+    /// @brief Runs per thread, so threads with quicker runs take over more of them.
+    static constexpr size_t RUNS_PER_THREAD = 8;
+};
+
+}
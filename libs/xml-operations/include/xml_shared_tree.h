@@ -0,0 +1,114 @@
+#pragma once
+
+#include "pugixml.hpp"
+
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace xmlops {
+
+/// @brief Document stored with identical subtrees only once, e.g. the same Cost or Locked block
+///        in thousands of assets or content a mod adds to many GUIDs.
+///        Nodes are immutable and hash-consed: building or adding a subtree that is already stored
+///        returns the stored node. Changes copy the nodes from the root down to the change and
+///        leave everything else shared. Nodes no longer reachable from the root are reclaimed,
+///        interned strings stay until the tree is destroyed.
+class XmlSharedTree
+{
+public:
+    struct Node {
+        pugi::xml_node_type type;
+        /// @brief Interned, equal strings have equal pointers.
+        std::string_view                                        name;
+        std::string_view                                        value;
+        std::vector<std::pair<std::string_view, std::string_view>> attributes;
+        std::vector<const Node*>                                children;
+
+        size_t hash;
+        /// @brief Nodes and estimated bytes of the subtree as if nothing was shared.
+        size_t tree_nodes;
+        size_t tree_bytes;
+        /// @brief Parents referencing this node, and the tree itself for the root.
+        mutable size_t uses = 0;
+    };
+
+    struct Stats {
+        /// @brief Nodes of the current document as if nothing was shared.
+        size_t nodes = 0;
+        size_t unique_nodes = 0;
+        /// @brief Estimated bytes without sharing, and what sharing saves of them.
+        size_t bytes = 0;
+        size_t saved_bytes = 0;
+        /// @brief Nodes held in memory, added ones not inserted yet included.
+        size_t stored_nodes = 0;
+    };
+
+    /// @brief Store root and its subtree.
+    static std::shared_ptr<XmlSharedTree> Build(pugi::xml_node root);
+
+    const Node* Root() const { return root_; }
+
+    /// @brief Store node and its subtree, or find it if already stored.
+    ///        Nodes added but never inserted stay until the tree is destroyed.
+    const Node* Add(pugi::xml_node node);
+
+    /// @brief Child indices from the root to node, to address the same node in the shared tree.
+    static std::vector<size_t> GetPath(pugi::xml_node node);
+    /// @brief Node at path, nullptr if there is none.
+    const Node* Get(const std::vector<size_t>& path) const;
+
+    /// @brief Copy-on-write changes of the node at path. Other occurrences of it stay unchanged.
+    /// @returns false if path does not exist.
+    bool Replace(const std::vector<size_t>& path, const Node* node);
+    /// @brief Insert before the node at path, or append if path ends one past the last child.
+    bool Insert(const std::vector<size_t>& path, const Node* node);
+    bool Remove(const std::vector<size_t>& path);
+
+    /// @brief Unformatted XML of node and its subtree.
+    ///        Shared subtrees are printed once and written again from the first output.
+    void Print(std::ostream& out, const Node* node) const;
+    /// @brief Append a pugixml copy of node and its subtree to parent.
+    pugi::xml_node CopyTo(const Node* node, pugi::xml_node parent) const;
+
+    Stats GetStats() const;
+
+private:
+    struct NodeHash {
+        size_t operator()(const Node* node) const { return node->hash; }
+    };
+    struct NodeEqual {
+        bool operator()(const Node* a, const Node* b) const;
+    };
+
+    std::deque<std::string>                          strings_;
+    std::unordered_set<std::string_view>             string_ids_;
+    std::deque<Node>                                 nodes_;
+    /// @brief Slots of reclaimed nodes in nodes_, reused first.
+    std::vector<Node*>                               free_;
+    std::unordered_set<const Node*, NodeHash, NodeEqual> unique_;
+    const Node*                                      root_ = nullptr;
+
+    std::string_view Intern(std::string_view text);
+    const Node*      Intern(Node&& node);
+    void             SetRoot(const Node* root);
+    /// @brief Drop a use of node, reclaim it and release its children once nothing uses it anymore.
+    void             Release(const Node* node);
+    /// @brief Copy of node with the children of the parent of path changed, and of its ancestors.
+    /// @returns nullptr if path does not exist or change fails.
+    template <class Change>
+    const Node* Rebuild(const Node* node, const std::vector<size_t>& path, size_t depth, Change& change);
+
+    /// @param printed Offset and size in output of shared nodes printed before.
+    void Print(const Node* node, std::unordered_map<const Node*, std::pair<size_t, size_t>>& printed,
+               std::string& output) const;
+};
+
+}
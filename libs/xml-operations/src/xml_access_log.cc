@@ -0,0 +1,115 @@
+#include "xml_access_log.h"
+#include "xml_document_state.h"
+#include "xml_index.h"
+
+namespace xmlops {
+
+void XmlAccessSet::Merge(const XmlAccessSet& other)
+{
+    keys.insert(other.keys.begin(), other.keys.end());
+    all = all || other.all;
+}
+
+bool XmlAccessSet::Intersects(const XmlAccessSet& writes) const
+{
+    if (all) {
+        return !writes.empty();
+    }
+
+    // both are sorted, walk the smaller one
+    const auto& small = keys.size() < writes.keys.size() ? keys : writes.keys;
+    const auto& large = keys.size() < writes.keys.size() ? writes.keys : keys;
+    for (const auto& key : small) {
+        if (large.count(key)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+XmlAccessLog::XmlAccessLog(std::weak_ptr<pugi::xml_document> doc)
+    : doc_(std::move(doc))
+{
+}
+
+std::shared_ptr<XmlAccessLog> XmlAccessLog::Start(const std::shared_ptr<pugi::xml_document>& doc)
+{
+    if (auto log = Get(doc)) {
+        return log;
+    }
+    return XmlDocumentState::Emplace(XmlDocumentState::AccessLog, doc, std::make_shared<XmlAccessLog>(doc));
+}
+
+std::shared_ptr<XmlAccessLog> XmlAccessLog::Get(const std::shared_ptr<pugi::xml_document>& doc)
+{
+    return XmlDocumentState::Get<XmlAccessLog>(XmlDocumentState::AccessLog, doc);
+}
+
+void XmlAccessLog::Stop(const std::shared_ptr<pugi::xml_document>& doc)
+{
+    XmlDocumentState::Erase(XmlDocumentState::AccessLog, doc.get());
+}
+
+XmlAccessLog::Entry& XmlAccessLog::Add(std::string file, size_t line, std::string guid)
+{
+    auto& entry = entries_.emplace_back();
+    entry.file  = std::move(file);
+    entry.line  = line;
+    entry.guid  = std::move(guid);
+    return entry;
+}
+
+// Keyed elements below node, not searching nested ones. Same as XmlIndex does.
+static bool AddKeyed(const XmlIndex& index, pugi::xml_node node, XmlAccessSet& writes)
+{
+    bool found = false;
+    for (auto child = node.first_child(); child; child = child.next_sibling()) {
+        size_t      rule;
+        std::string key;
+        if (index.GetKey(child, rule, key)) {
+            writes.Add(rule, std::move(key));
+            found = true;
+        }
+        else if (child.type() == pugi::node_element) {
+            found = AddKeyed(index, child, writes) || found;
+        }
+    }
+    return found;
+}
+
+void XmlAccessLog::Wrote(Entry& entry, pugi::xml_node node)
+{
+    const auto doc = doc_.lock();
+    if (!doc || !node) {
+        return;
+    }
+
+    const auto index = XmlIndex::Get(doc);
+    for (auto keyed = node; keyed; keyed = keyed.parent()) {
+        size_t      rule;
+        std::string key;
+        if (index->GetKey(keyed, rule, key)) {
+            entry.writes.Add(rule, std::move(key));
+            return;
+        }
+    }
+
+    // e.g. assets added to or removed from a group
+    if (!AddKeyed(*index, node, entry.writes)) {
+        entry.writes.all = true;
+    }
+}
+
+std::vector<size_t> XmlAccessLog::GetAffected(XmlAccessSet changed, size_t first) const
+{
+    std::vector<size_t> affected;
+    for (size_t i = first; i < entries_.size(); i++) {
+        if (entries_[i].reads.Intersects(changed)) {
+            affected.push_back(i);
+            changed.Merge(entries_[i].writes);
+        }
+    }
+    return affected;
+}
+
+}
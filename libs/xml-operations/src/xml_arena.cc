@@ -0,0 +1,415 @@
+#include "xml_arena.h"
+#include "xml_document_state.h"
+#include "xml_memory.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <mutex>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+namespace xmlops {
+
+static constexpr size_t ALIGNMENT = alignof(std::max_align_t);
+
+static std::atomic<bool>          installed      = false;
+static std::atomic<bool>          hooked         = false;
+static pugi::allocation_function   previous_allocate   = nullptr;
+static pugi::deallocation_function previous_deallocate = nullptr;
+static std::atomic<bool>          use_huge_pages = false;
+static thread_local XmlArena*     current_arena  = nullptr;
+
+// Chunks of all arenas are aligned to granules and marked in a two level bitmap by address,
+// so frees tell arena blocks from heap blocks with two loads and without locking.
+static constexpr size_t GRANULE_SHIFT = 16;
+static constexpr size_t GRANULE       = size_t{1} << GRANULE_SHIFT;
+static constexpr size_t ADDRESS_BITS  = 47;
+static constexpr size_t LEAF_SHIFT    = 16;
+static constexpr size_t ROOT_SIZE     = size_t{1} << (ADDRESS_BITS - GRANULE_SHIFT - LEAF_SHIFT);
+
+struct GranuleLeaf {
+    std::atomic<uint64_t> words[(size_t{1} << LEAF_SHIFT) / 64];
+};
+// leaves cover 4 GB of addresses each and are never freed
+static std::atomic<GranuleLeaf*> granules[ROOT_SIZE];
+static std::mutex                granules_mutex;
+
+static std::mutex             recycled_mutex;
+static std::vector<XmlArena*> recycled;
+
+static struct {
+    std::atomic<size_t> reserved_bytes   = 0;
+    std::atomic<size_t> huge_page_chunks = 0;
+    std::atomic<size_t> arenas_created   = 0;
+    std::atomic<size_t> arenas_recycled  = 0;
+    std::atomic<size_t> arenas_in_use    = 0;
+} stats;
+
+// Counted per thread and summed up when read, hooks run for every pugixml block of all threads.
+struct BlockStats {
+    std::atomic<size_t> arena_allocations = 0;
+    std::atomic<size_t> arena_bytes       = 0;
+    std::atomic<size_t> arena_frees       = 0;
+    std::atomic<size_t> arena_freed_bytes = 0;
+    std::atomic<size_t> heap_allocations  = 0;
+    std::atomic<size_t> heap_bytes        = 0;
+    std::atomic<size_t> heap_frees        = 0;
+    bool                in_use            = false;
+};
+static std::mutex block_stats_mutex;
+// never destroyed, pugixml may still free blocks while statics of other files are destroyed
+static auto&                    block_stats        = *new std::deque<BlockStats>(1);
+static thread_local BlockStats* thread_block_stats = nullptr;
+static thread_local bool        thread_exited      = false;
+
+// Hands the stats of an exiting thread to the next new one.
+struct BlockStatsRelease {
+    ~BlockStatsRelease()
+    {
+        std::scoped_lock lock{block_stats_mutex};
+        thread_block_stats->in_use = false;
+        thread_block_stats         = nullptr;
+        thread_exited              = true;
+    }
+};
+
+static BlockStats& GetBlockStats()
+{
+    if (auto thread_stats = thread_block_stats) {
+        return *thread_stats;
+    }
+
+    std::scoped_lock lock{block_stats_mutex};
+    if (thread_exited) {
+        // shared by all threads past their release
+        return block_stats.front();
+    }
+    auto it = std::find_if(block_stats.begin() + 1, block_stats.end(), [](const auto& entry) { return !entry.in_use; });
+    thread_block_stats         = it != block_stats.end() ? &*it : &block_stats.emplace_back();
+    thread_block_stats->in_use = true;
+    static thread_local BlockStatsRelease release;
+    return *thread_block_stats;
+}
+
+static bool MarkGranules(const char* data, size_t size, bool arena)
+{
+    const auto first = reinterpret_cast<uintptr_t>(data) >> GRANULE_SHIFT;
+    const auto last  = (reinterpret_cast<uintptr_t>(data) + size - 1) >> GRANULE_SHIFT;
+    if (last >> (ADDRESS_BITS - GRANULE_SHIFT)) {
+        return false;
+    }
+
+    std::scoped_lock lock{granules_mutex};
+    for (auto granule = first; granule <= last; granule++) {
+        auto& root = granules[granule >> LEAF_SHIFT];
+        auto  leaf = root.load(std::memory_order_acquire);
+        if (!leaf) {
+            leaf = new GranuleLeaf{};
+            root.store(leaf, std::memory_order_release);
+        }
+        const auto bit  = granule & ((size_t{1} << LEAF_SHIFT) - 1);
+        const auto mask = uint64_t{1} << (bit % 64);
+        if (arena) {
+            leaf->words[bit / 64].fetch_or(mask, std::memory_order_release);
+        }
+        else {
+            leaf->words[bit / 64].fetch_and(~mask, std::memory_order_release);
+        }
+    }
+    return true;
+}
+
+static bool IsArenaBlock(const void* block)
+{
+    const auto granule = reinterpret_cast<uintptr_t>(block) >> GRANULE_SHIFT;
+    if (granule >> (ADDRESS_BITS - GRANULE_SHIFT)) {
+        return false;
+    }
+    const auto leaf = granules[granule >> LEAF_SHIFT].load(std::memory_order_acquire);
+    if (!leaf) {
+        return false;
+    }
+    const auto bit = granule & ((size_t{1} << LEAF_SHIFT) - 1);
+    return leaf->words[bit / 64].load(std::memory_order_acquire) & (uint64_t{1} << (bit % 64));
+}
+
+void XmlArena::Install(bool huge_pages)
+{
+    use_huge_pages = huge_pages;
+    if (!installed.exchange(true) && !hooked.exchange(true)) {
+        previous_allocate   = pugi::get_memory_allocation_function();
+        previous_deallocate = pugi::get_memory_deallocation_function();
+        pugi::set_memory_management_functions(AllocateHook, DeallocateHook);
+    }
+}
+
+bool XmlArena::Uninstall()
+{
+    installed = false;
+    if (!hooked) {
+        return true;
+    }
+    // frees of blocks in arenas must still be caught
+    if (stats.arenas_in_use > 0) {
+        return false;
+    }
+    hooked = false;
+    pugi::set_memory_management_functions(previous_allocate, previous_deallocate);
+    return true;
+}
+
+bool XmlArena::IsInstalled()
+{
+    return installed;
+}
+
+std::shared_ptr<pugi::xml_document> XmlArena::MakeDocument()
+{
+    if (!installed) {
+        return std::shared_ptr<pugi::xml_document>(new pugi::xml_document(), Deleter{nullptr});
+    }
+
+    XmlArena* arena = nullptr;
+    {
+        std::scoped_lock lock{recycled_mutex};
+        if (!recycled.empty()) {
+            arena = recycled.back();
+            recycled.pop_back();
+            stats.arenas_recycled++;
+        }
+    }
+    if (!arena) {
+        arena = new XmlArena();
+        stats.arenas_created++;
+    }
+    stats.arenas_in_use++;
+    return std::shared_ptr<pugi::xml_document>(new pugi::xml_document(), Deleter{arena});
+}
+
+void XmlArena::Deleter::operator()(pugi::xml_document* doc) const
+{
+    XmlDocumentState::Drop(doc);
+
+    // frees of the document's blocks are no-ops, the arena releases them all at once
+    delete doc;
+    if (!arena) {
+        return;
+    }
+    arena->Reset(MAX_RECYCLED_BYTES);
+    stats.arenas_in_use--;
+
+    std::scoped_lock lock{recycled_mutex};
+    if (recycled.size() < MAX_RECYCLED) {
+        recycled.push_back(arena);
+    }
+    else {
+        delete arena;
+    }
+}
+
+XmlArena::Scope::Scope(const std::shared_ptr<pugi::xml_document>& doc)
+    : previous_(current_arena)
+{
+    if (auto deleter = std::get_deleter<Deleter>(doc)) {
+        current_arena = deleter->arena;
+    }
+}
+
+XmlArena::Scope::~Scope()
+{
+    current_arena = previous_;
+}
+
+XmlArena::Stats XmlArena::GetStats()
+{
+    Stats result;
+    {
+        std::scoped_lock lock{block_stats_mutex};
+        for (const auto& entry : block_stats) {
+            result.arena_allocations += entry.arena_allocations;
+            result.arena_bytes += entry.arena_bytes;
+            result.arena_frees += entry.arena_frees;
+            result.arena_freed_bytes += entry.arena_freed_bytes;
+            result.heap_allocations += entry.heap_allocations;
+            result.heap_bytes += entry.heap_bytes;
+            result.heap_frees += entry.heap_frees;
+        }
+    }
+    {
+        std::scoped_lock lock{recycled_mutex};
+        for (const auto arena : recycled) {
+            for (const auto& chunk : arena->chunks_) {
+                result.recycled_bytes += chunk.size;
+            }
+        }
+    }
+    result.reserved_bytes    = stats.reserved_bytes;
+    result.huge_page_chunks  = stats.huge_page_chunks;
+    result.arenas_created    = stats.arenas_created;
+    result.arenas_recycled   = stats.arenas_recycled;
+    result.arenas_in_use     = stats.arenas_in_use;
+    return result;
+}
+
+XmlArena::~XmlArena()
+{
+    for (const auto& chunk : chunks_) {
+        FreeChunk(chunk);
+    }
+}
+
+void* XmlArena::Allocate(size_t size)
+{
+    size = (size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+    while (current_ < chunks_.size() && used_ + size > chunks_[current_].size) {
+        current_++;
+        used_ = 0;
+    }
+    if (current_ == chunks_.size()) {
+        const auto next = chunks_.empty() ? MIN_CHUNK_SIZE : std::min(chunks_.back().size * 2, CHUNK_SIZE);
+        auto       chunk = AllocateChunk(std::max(size, next));
+        if (!chunk.data) {
+            return nullptr;
+        }
+        chunks_.push_back(chunk);
+        used_ = 0;
+    }
+
+    auto block = chunks_[current_].data + used_;
+    used_ += size;
+    return block;
+}
+
+void XmlArena::Reset(size_t keep)
+{
+    size_t kept = 0;
+    auto   it   = chunks_.begin();
+    for (; it != chunks_.end() && kept + it->size <= keep; ++it) {
+        kept += it->size;
+    }
+    for (auto free = it; free != chunks_.end(); ++free) {
+        FreeChunk(*free);
+    }
+    chunks_.erase(it, chunks_.end());
+    current_ = 0;
+    used_    = 0;
+}
+
+XmlArena::Chunk XmlArena::AllocateChunk(size_t size)
+{
+    // whole granules, so no granule is shared with heap blocks
+    size = (size + GRANULE - 1) / GRANULE * GRANULE;
+    Chunk chunk{nullptr, size, false};
+    if (use_huge_pages) {
+#ifdef _WIN32
+        // needs the lock pages privilege, falls back to normal pages without
+        if (const size_t page = GetLargePageMinimum()) {
+            chunk.size = (size + page - 1) / page * page;
+            chunk.data = static_cast<char*>(
+                VirtualAlloc(nullptr, chunk.size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE));
+            chunk.huge = chunk.data != nullptr;
+        }
+#else
+        constexpr size_t page = 2 << 20;
+        chunk.size = (size + page - 1) / page * page;
+        chunk.data = static_cast<char*>(std::aligned_alloc(page, chunk.size));
+#ifdef MADV_HUGEPAGE
+        chunk.huge = chunk.data && madvise(chunk.data, chunk.size, MADV_HUGEPAGE) == 0;
+#endif
+#endif
+    }
+    if (!chunk.data) {
+        chunk.size = size;
+#ifdef _WIN32
+        // allocations are aligned to 64 KB, the same as granules
+        chunk.data = static_cast<char*>(VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+#else
+        chunk.data = static_cast<char*>(std::aligned_alloc(GRANULE, size));
+#endif
+        if (!chunk.data) {
+            return chunk;
+        }
+    }
+    if (!MarkGranules(chunk.data, chunk.size, true)) {
+        Release(chunk);
+        return {nullptr, size, false};
+    }
+
+    stats.reserved_bytes += chunk.size;
+    stats.huge_page_chunks += chunk.huge ? 1 : 0;
+    XmlMemory::Allocated(chunk.data, chunk.size);
+    return chunk;
+}
+
+void XmlArena::FreeChunk(const Chunk& chunk)
+{
+    MarkGranules(chunk.data, chunk.size, false);
+    stats.reserved_bytes -= chunk.size;
+    stats.huge_page_chunks -= chunk.huge ? 1 : 0;
+    XmlMemory::Freed(chunk.data);
+    Release(chunk);
+}
+
+void XmlArena::Release(const Chunk& chunk)
+{
+#ifdef _WIN32
+    VirtualFree(chunk.data, 0, MEM_RELEASE);
+#else
+    free(chunk.data);
+#endif
+}
+
+void* XmlArena::AllocateHook(size_t size)
+{
+    auto& block_stats = GetBlockStats();
+    if (auto arena = current_arena) {
+        // blocks are pages and long strings, their size in front costs little
+        if (auto block = static_cast<char*>(arena->Allocate(size + ALIGNMENT))) {
+            block_stats.arena_allocations.fetch_add(1, std::memory_order_relaxed);
+            block_stats.arena_bytes.fetch_add(size, std::memory_order_relaxed);
+            *reinterpret_cast<size_t*>(block) = size;
+            return block + ALIGNMENT;
+        }
+    }
+
+    block_stats.heap_allocations.fetch_add(1, std::memory_order_relaxed);
+    block_stats.heap_bytes.fetch_add(size, std::memory_order_relaxed);
+    auto block = malloc(size);
+    if (block && XmlMemory::IsCountingBlocks()) {
+        XmlMemory::Allocated(block, size);
+    }
+    return block;
+}
+
+void XmlArena::DeallocateHook(void* ptr)
+{
+    if (!ptr) {
+        return;
+    }
+
+    if (IsArenaBlock(ptr)) {
+        // released together with its arena
+        auto& block_stats = GetBlockStats();
+        block_stats.arena_frees.fetch_add(1, std::memory_order_relaxed);
+        block_stats.arena_freed_bytes.fetch_add(*reinterpret_cast<const size_t*>(static_cast<char*>(ptr) - ALIGNMENT),
+                                                std::memory_order_relaxed);
+        return;
+    }
+
+    GetBlockStats().heap_frees.fetch_add(1, std::memory_order_relaxed);
+    if (XmlMemory::IsCountingBlocks()) {
+        XmlMemory::Freed(ptr);
+    }
+    free(ptr);
+}
+
+}
@@ -5,9 +5,11 @@
 
 namespace fs = std::filesystem;
 
+#include "xml_arena.h"
 #include "xml_auto_serializer.h"
 #include "xml_filedb_reader.h"
 #include "xml_fc_reader.h"
+#include "xml_printer.h"
 
 namespace xmlops {
 
@@ -31,7 +33,8 @@ std::shared_ptr<pugi::xml_document> XmlAutoSerializer::read(const void* data, si
         return xmlops::FcReader::read(data, size, file_name);
     }
     else {
-        auto doc = std::make_shared<pugi::xml_document>();
+        auto doc = XmlArena::MakeDocument();
+        XmlArena::Scope arena{doc};
         doc->load_buffer(data, size);
         return doc;
     }
@@ -66,7 +69,8 @@ void XmlAutoSerializer::write(pugi::xml_document* doc, std::ostream& stream, con
         FcWriter::write(doc, stream, file_name);
     }
     else {
-        doc->print(stream, format ? "  " : "", format ? pugi::format_default : pugi::format_raw);
+        pugi::xml_writer_stream writer{stream};
+        XmlPrinter::Print(*doc, writer, format ? "  " : "", format ? pugi::format_default : pugi::format_raw);
     }
 }
 
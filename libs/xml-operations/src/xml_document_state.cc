@@ -0,0 +1,94 @@
+#include "xml_document_state.h"
+
+#include <array>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace xmlops {
+
+struct Entry {
+    std::weak_ptr<pugi::xml_document>                                doc;
+    std::array<std::shared_ptr<void>, XmlDocumentState::Kind::KINDS> objects;
+};
+struct States {
+    std::mutex                                              mutex;
+    std::unordered_map<const pugi::xml_document*, Entry> entries;
+};
+
+// never destroyed, documents may still be destroyed after statics are
+static States& GetStates()
+{
+    static auto* states = new States();
+    return *states;
+}
+
+std::shared_ptr<void> XmlDocumentState::GetAny(Kind kind, const std::shared_ptr<pugi::xml_document>& doc)
+{
+    auto&            states = GetStates();
+    std::scoped_lock lock{states.mutex};
+    if (states.entries.empty() || !doc) {
+        return {};
+    }
+    auto it = states.entries.find(doc.get());
+    // other documents can be reallocated at the same address, so make sure it's still the same one
+    if (it == states.entries.end() || it->second.doc.lock() != doc) {
+        return {};
+    }
+    return it->second.objects[kind];
+}
+
+std::shared_ptr<void> XmlDocumentState::EmplaceAny(Kind kind, const std::shared_ptr<pugi::xml_document>& doc,
+                                                   std::shared_ptr<void> value)
+{
+    // objects of gone documents are destroyed after unlocking
+    std::vector<Entry> dropped;
+
+    auto&            states = GetStates();
+    std::scoped_lock lock{states.mutex};
+    auto             it = states.entries.find(doc.get());
+    if (it == states.entries.end() || it->second.doc.lock() != doc) {
+        for (auto gone = states.entries.begin(); gone != states.entries.end();) {
+            if (gone->second.doc.expired()) {
+                dropped.push_back(std::move(gone->second));
+                gone = states.entries.erase(gone);
+            }
+            else {
+                ++gone;
+            }
+        }
+        it = states.entries.insert_or_assign(doc.get(), Entry{doc, {}}).first;
+    }
+
+    auto& object = it->second.objects[kind];
+    if (!object) {
+        object = std::move(value);
+    }
+    return object;
+}
+
+void XmlDocumentState::Erase(Kind kind, const pugi::xml_document* doc)
+{
+    std::shared_ptr<void> dropped;
+
+    auto&            states = GetStates();
+    std::scoped_lock lock{states.mutex};
+    if (auto it = states.entries.find(doc); it != states.entries.end()) {
+        dropped = std::move(it->second.objects[kind]);
+    }
+}
+
+void XmlDocumentState::Drop(const pugi::xml_document* doc)
+{
+    Entry dropped;
+    {
+        auto&            states = GetStates();
+        std::scoped_lock lock{states.mutex};
+        if (auto it = states.entries.find(doc); it != states.entries.end()) {
+            dropped = std::move(it->second);
+            states.entries.erase(it);
+        }
+    }
+}
+
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "pugixml.hpp"
+
+#include <memory>
+
+namespace xmlops {
+
+/// @brief Objects kept for a document, like its index.
+///        Those of documents made by XmlArena::MakeDocument are dropped when the document is destroyed.
+///        Other documents only lose theirs once another document gets some after they are gone.
+class XmlDocumentState
+{
+public:
+    enum Kind { Index, Journal, AccessLog, Lazy, KINDS };
+
+    template<typename T>
+    static std::shared_ptr<T> Get(Kind kind, const std::shared_ptr<pugi::xml_document>& doc)
+    {
+        return std::static_pointer_cast<T>(GetAny(kind, doc));
+    }
+
+    /// @brief Keep value for doc, unless there's one already.
+    /// @returns The one kept.
+    template<typename T>
+    static std::shared_ptr<T> Emplace(Kind kind, const std::shared_ptr<pugi::xml_document>& doc,
+                                      std::shared_ptr<T> value)
+    {
+        return std::static_pointer_cast<T>(EmplaceAny(kind, doc, std::move(value)));
+    }
+
+    static void Erase(Kind kind, const pugi::xml_document* doc);
+    /// @brief Drop all objects of doc. Called by the deleter of XmlArena::MakeDocument.
+    static void Drop(const pugi::xml_document* doc);
+
+private:
+    static std::shared_ptr<void> GetAny(Kind kind, const std::shared_ptr<pugi::xml_document>& doc);
+    static std::shared_ptr<void> EmplaceAny(Kind kind, const std::shared_ptr<pugi::xml_document>& doc,
+                                            std::shared_ptr<void> value);
+};
+
+}
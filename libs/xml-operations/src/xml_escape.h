@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstddef>
+#include <string_view>
+
+namespace xmlops {
+
+/// @brief Pass text to write in pieces, with characters escaped the way pugixml prints them.
+/// @param attribute Escape quotes and whitespace of attribute values as well.
+template <class Write> void WriteEscaped(std::string_view text, bool attribute, Write&& write)
+{
+    size_t start = 0;
+    for (size_t i = 0; i < text.size(); i++) {
+        const char* escaped = nullptr;
+        switch (text[i]) {
+        case '&': escaped = "&amp;"; break;
+        case '<': escaped = "&lt;"; break;
+        case '>': escaped = "&gt;"; break;
+        case '"': escaped = attribute ? "&quot;" : nullptr; break;
+        case '\t': escaped = attribute ? "&#9;" : nullptr; break;
+        case '\n': escaped = attribute ? "&#10;" : nullptr; break;
+        case '\r': escaped = attribute ? "&#13;" : nullptr; break;
+        }
+        if (escaped) {
+            write(text.substr(start, i - start));
+            write(std::string_view{escaped});
+            start = i + 1;
+        }
+    }
+    write(text.substr(start));
+}
+
+}
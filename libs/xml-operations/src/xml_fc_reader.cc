@@ -14,6 +14,7 @@
 namespace fs = std::filesystem;
 
 #include "xml_fc_reader.h"
+#include "xml_arena.h"
 
 namespace xmlops {
 
@@ -51,7 +52,8 @@ std::shared_ptr<pugi::xml_document> FcReader::read(std::istream& stream, const f
         }
     }
 
-    auto doc = std::make_shared<pugi::xml_document>();
+    auto doc = XmlArena::MakeDocument();
+    XmlArena::Scope arena{doc};
     doc->load_string(true_xml.str().c_str());
     return doc;
 }
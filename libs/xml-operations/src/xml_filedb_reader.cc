@@ -16,6 +16,7 @@
 namespace fs = std::filesystem;
 
 #include "xml_filedb_reader.h"
+#include "xml_arena.h"
 
 namespace xmlops {
 
@@ -194,7 +195,8 @@ std::shared_ptr<pugi::xml_document> FileDbReader::read(std::istream& stream, con
         return {};
     }
 
-    auto doc = std::make_shared<pugi::xml_document>();
+    auto doc = XmlArena::MakeDocument();
+    XmlArena::Scope arena{doc};
     pugi::xml_node root = doc->append_child("Content");
     reader.construct_xml(&root, &reader._root);
 
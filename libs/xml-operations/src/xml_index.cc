@@ -0,0 +1,427 @@
+#include "xml_index.h"
+#include "xml_document_state.h"
+
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <utility>
+
+namespace xmlops {
+
+#ifndef _WIN32
+static int stricmp(const char* a, const char* b)
+{
+    return strcasecmp(a, b);
+}
+#endif
+
+// True if a comes before b in document order.
+static bool IsBefore(pugi::xml_node a, pugi::xml_node b)
+{
+    const auto depth = [](pugi::xml_node node) {
+        size_t result = 0;
+        for (; node.parent(); node = node.parent()) {
+            result++;
+        }
+        return result;
+    };
+
+    if (a == b) {
+        return false;
+    }
+
+    auto depth_a = depth(a);
+    auto depth_b = depth(b);
+    for (; depth_a > depth_b; depth_a--) {
+        a = a.parent();
+        if (a == b) {
+            return false;
+        }
+    }
+    for (; depth_b > depth_a; depth_b--) {
+        b = b.parent();
+        if (a == b) {
+            return true;
+        }
+    }
+    while (a.parent() != b.parent()) {
+        a = a.parent();
+        b = b.parent();
+    }
+    for (auto node = a.next_sibling(); node; node = node.next_sibling()) {
+        if (node == b) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static std::mutex                                rules_mutex;
+static std::shared_ptr<const XmlIndex::rules_t> rules = std::make_shared<XmlIndex::rules_t>(
+    XmlIndex::rules_t{
+        // assets.xml, order must match ASSET_RULE and TEMPLATE_RULE
+        {"Asset", "Values/Standard/GUID", XmlIndexRule::NUMBER},
+        // templates.xml
+        {"Template", "Name", XmlIndexRule::STRING},
+        // texts_*.xml
+        {"Text", "GUID", XmlIndexRule::NUMBER},
+        // export.bin infotips
+        {"InfoTipData", "Guid", XmlIndexRule::NUMBER},
+    });
+
+// XPath string-value, i.e. all descendant text concatenated.
+static std::string GetStringValue(pugi::xml_node node)
+{
+    if (node.type() == pugi::node_pcdata || node.type() == pugi::node_cdata) {
+        return node.value();
+    }
+
+    std::string result;
+    for (auto child = node.first_child(); child; child = child.next_sibling()) {
+        result += GetStringValue(child);
+    }
+    return result;
+}
+
+static void CollectValues(pugi::xml_node node, const std::vector<std::string>& steps, size_t step,
+                          std::vector<std::string>& values)
+{
+    if (step == steps.size()) {
+        auto value = GetStringValue(node);
+        if (std::find(values.begin(), values.end(), value) == values.end()) {
+            values.emplace_back(std::move(value));
+        }
+        return;
+    }
+    const auto name = steps[step].c_str();
+    for (auto child = node.child(name); child; child = child.next_sibling(name)) {
+        CollectValues(child, steps, step + 1, values);
+    }
+}
+
+XmlIndex::XmlIndex(pugi::xml_node root)
+{
+    root_  = root;
+    rules_ = GetRules();
+    maps_.resize(rules_->size());
+    for (const auto& rule : *rules_) {
+        auto& steps = key_steps_.emplace_back();
+        for (size_t last = 0; last <= rule.key_path.size();) {
+            auto next = std::min(rule.key_path.find('/', last), rule.key_path.size());
+            if (next > last) {
+                steps.emplace_back(rule.key_path.substr(last, next - last));
+            }
+            last = next + 1;
+        }
+    }
+
+    Walk(root, true);
+}
+
+std::shared_ptr<XmlIndex> XmlIndex::Get(const std::shared_ptr<pugi::xml_document>& doc, bool build)
+{
+    if (!doc) {
+        return {};
+    }
+    if (auto index = XmlDocumentState::Get<XmlIndex>(XmlDocumentState::Index, doc); index || !build) {
+        return index;
+    }
+    return XmlDocumentState::Emplace(XmlDocumentState::Index, doc, std::make_shared<XmlIndex>(doc->root()));
+}
+
+void XmlIndex::AddRule(XmlIndexRule rule)
+{
+    std::scoped_lock lock{rules_mutex};
+    auto             updated = std::make_shared<rules_t>(*rules);
+    updated->emplace_back(std::move(rule));
+    rules = updated;
+}
+
+std::shared_ptr<const XmlIndex::rules_t> XmlIndex::GetRules()
+{
+    std::scoped_lock lock{rules_mutex};
+    return rules;
+}
+
+size_t XmlIndex::Count(size_t rule, const std::string& key) const
+{
+    return rule < maps_.size() ? maps_[rule].count(key) : 0;
+}
+
+pugi::xml_node XmlIndex::Find(size_t rule, const std::string& key) const
+{
+    if (rule >= maps_.size()) {
+        return {};
+    }
+
+    auto [begin, end] = maps_[rule].equal_range(key);
+    if (begin == end) {
+        return {};
+    }
+
+    // duplicates are rare, but we have to return the same as a tree walk would
+    auto result = begin->second;
+    for (auto it = std::next(begin); it != end; ++it) {
+        if (IsBefore(it->second, result)) {
+            result = it->second;
+        }
+    }
+    return result;
+}
+
+bool XmlIndex::GetKey(pugi::xml_node node, size_t& rule, std::string& key) const
+{
+    auto entry = entries_.find(node.internal_object());
+    if (entry == entries_.end()) {
+        return false;
+    }
+    rule = entry->second.rule;
+    key  = entry->second.key;
+    return true;
+}
+
+bool XmlIndex::FindByValue(const std::string& element, const std::string& child_path,
+                           const std::string& value, std::vector<pugi::xml_node>& results)
+{
+    auto& index = value_indices_[element + "[" + child_path + "]"];
+    if (!index.built) {
+        // building costs about as much as a single XPath scan, so only do it for repeated shapes
+        if (++index.uses < VALUE_INDEX_THRESHOLD) {
+            return false;
+        }
+
+        index.element = element;
+        for (size_t last = 0; last <= child_path.size();) {
+            auto next = std::min(child_path.find('/', last), child_path.size());
+            if (next > last) {
+                index.child_steps.emplace_back(child_path.substr(last, next - last));
+            }
+            last = next + 1;
+        }
+        index.built = true;
+        WalkValues(root_, true, {&index});
+        built_value_indices_.push_back(&index);
+    }
+
+    auto [begin, end] = index.map.equal_range(value);
+    for (auto it = begin; it != end; ++it) {
+        results.push_back(it->second);
+    }
+    return true;
+}
+
+void XmlIndex::Insert(pugi::xml_node node)
+{
+    if (auto rule = GetRule(node); rule != NONE) {
+        Add(node, rule);
+    }
+    else {
+        Walk(node, true);
+    }
+    WalkValues(node, true, built_value_indices_);
+    Update(node.parent());
+}
+
+void XmlIndex::Remove(pugi::xml_node node)
+{
+    if (GetRule(node) != NONE) {
+        Erase(node);
+    }
+    else {
+        Walk(node, false);
+    }
+    WalkValues(node, false, built_value_indices_);
+    DropMemos(node);
+    Touch(node.parent());
+}
+
+void XmlIndex::Update(pugi::xml_node node)
+{
+    Touch(node);
+    for (; node; node = node.parent()) {
+        if (auto rule = GetRule(node); rule != NONE) {
+            Erase(node);
+            Add(node, rule);
+        }
+        for (auto index : built_value_indices_) {
+            if (index->element == node.name()) {
+                EraseValues(*index, node);
+                AddValues(*index, node);
+            }
+        }
+    }
+}
+
+void XmlIndex::Touch(pugi::xml_node node)
+{
+    generation_++;
+    if (memo_roots_.empty()) {
+        return;
+    }
+    for (; node; node = node.parent()) {
+        if (auto it = memo_roots_.find(node.internal_object()); it != memo_roots_.end()) {
+            it->second.changed = generation_;
+        }
+    }
+}
+
+const pugi::xpath_node_set* XmlIndex::GetMemo(pugi::xml_node root, const std::string& path) const
+{
+    auto root_it = memo_roots_.find(root.internal_object());
+    if (root_it == memo_roots_.end()) {
+        return nullptr;
+    }
+    auto it = root_it->second.memos.find(path);
+    if (it == root_it->second.memos.end() || it->second.generation < root_it->second.changed) {
+        return nullptr;
+    }
+    return &it->second.results;
+}
+
+void XmlIndex::SetMemo(pugi::xml_node root, const std::string& path, const pugi::xpath_node_set& results)
+{
+    memo_roots_[root.internal_object()].memos[path] = {generation_, results};
+}
+
+// Removed nodes may be reallocated, their memos must not survive.
+void XmlIndex::DropMemos(pugi::xml_node node)
+{
+    if (memo_roots_.empty() || node.type() != pugi::node_element) {
+        return;
+    }
+    memo_roots_.erase(node.internal_object());
+    for (auto child = node.first_child(); child; child = child.next_sibling()) {
+        DropMemos(child);
+    }
+}
+
+size_t XmlIndex::GetRule(pugi::xml_node node) const
+{
+    if (node.type() != pugi::node_element) {
+        return NONE;
+    }
+    for (size_t i = 0; i < rules_->size(); i++) {
+        if (stricmp(node.name(), (*rules_)[i].element.c_str()) == 0) {
+            return i;
+        }
+    }
+    return NONE;
+}
+
+pugi::xml_node XmlIndex::GetKeyNode(pugi::xml_node node, size_t rule) const
+{
+    for (const auto& step : key_steps_[rule]) {
+        node = node.child(step.c_str());
+    }
+    return node;
+}
+
+void XmlIndex::Add(pugi::xml_node node, size_t rule)
+{
+    auto key_node = GetKeyNode(node, rule);
+    if (!key_node) {
+        return;
+    }
+
+    std::string key = key_node.text().get();
+    maps_[rule].emplace(key, node);
+    entries_[node.internal_object()] = {rule, std::move(key)};
+}
+
+void XmlIndex::Erase(pugi::xml_node node)
+{
+    auto entry = entries_.find(node.internal_object());
+    if (entry == entries_.end()) {
+        return;
+    }
+
+    auto& map          = maps_[entry->second.rule];
+    auto [begin, end] = map.equal_range(entry->second.key);
+    for (auto it = begin; it != end; ++it) {
+        if (it->second == node) {
+            map.erase(it);
+            break;
+        }
+    }
+    entries_.erase(entry);
+}
+
+// Keyed elements are not searched for nested keyed elements, same as a GUID tree walk.
+void XmlIndex::Walk(pugi::xml_node node, bool insert)
+{
+    for (auto child = node.first_child(); child; child = child.next_sibling()) {
+        if (child.type() != pugi::node_element) {
+            continue;
+        }
+
+        if (auto rule = GetRule(child); rule != NONE) {
+            if (insert) {
+                Add(child, rule);
+            }
+            else {
+                Erase(child);
+            }
+        }
+        else {
+            Walk(child, insert);
+        }
+    }
+}
+
+void XmlIndex::AddValues(ValueIndex& index, pugi::xml_node node)
+{
+    std::vector<std::string> values;
+    CollectValues(node, index.child_steps, 0, values);
+    if (values.empty()) {
+        return;
+    }
+
+    for (const auto& value : values) {
+        index.map.emplace(value, node);
+    }
+    index.entries[node.internal_object()] = std::move(values);
+}
+
+void XmlIndex::EraseValues(ValueIndex& index, pugi::xml_node node)
+{
+    auto entry = index.entries.find(node.internal_object());
+    if (entry == index.entries.end()) {
+        return;
+    }
+
+    for (const auto& value : entry->second) {
+        auto [begin, end] = index.map.equal_range(value);
+        for (auto it = begin; it != end; ++it) {
+            if (it->second == node) {
+                index.map.erase(it);
+                break;
+            }
+        }
+    }
+    index.entries.erase(entry);
+}
+
+// Unlike keyed elements, values are searched in the whole subtree.
+void XmlIndex::WalkValues(pugi::xml_node node, bool insert, const std::vector<ValueIndex*>& indices)
+{
+    if (indices.empty() ||
+        (node.type() != pugi::node_element && node.type() != pugi::node_document)) {
+        return;
+    }
+
+    for (auto index : indices) {
+        if (index->element == node.name()) {
+            if (insert) {
+                AddValues(*index, node);
+            }
+            else {
+                EraseValues(*index, node);
+            }
+        }
+    }
+    for (auto child = node.first_child(); child; child = child.next_sibling()) {
+        WalkValues(child, insert, indices);
+    }
+}
+
+}
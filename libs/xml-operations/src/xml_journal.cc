@@ -0,0 +1,150 @@
+#include "xml_journal.h"
+#include "xml_document_state.h"
+#include "xml_index.h"
+
+namespace xmlops {
+
+// Nodes of a subtree in document order, the same for a copy of it.
+template<typename F> static void Visit(pugi::xml_node node, const F& visit)
+{
+    visit(node);
+    for (auto child = node.first_child(); child; child = child.next_sibling()) {
+        Visit(child, visit);
+    }
+}
+
+XmlJournal::XmlJournal(std::weak_ptr<pugi::xml_document> doc)
+    : doc_(std::move(doc))
+{
+}
+
+std::shared_ptr<XmlJournal> XmlJournal::Start(const std::shared_ptr<pugi::xml_document>& doc)
+{
+    if (auto journal = Get(doc)) {
+        return journal;
+    }
+    return XmlDocumentState::Emplace(XmlDocumentState::Journal, doc, std::make_shared<XmlJournal>(doc));
+}
+
+std::shared_ptr<XmlJournal> XmlJournal::Get(const std::shared_ptr<pugi::xml_document>& doc)
+{
+    return XmlDocumentState::Get<XmlJournal>(XmlDocumentState::Journal, doc);
+}
+
+void XmlJournal::Stop(const std::shared_ptr<pugi::xml_document>& doc)
+{
+    XmlDocumentState::Erase(XmlDocumentState::Journal, doc.get());
+}
+
+void XmlJournal::Inserted(pugi::xml_node node)
+{
+    if (node) {
+        entries_.push_back({Insert, node, {}, {}, {}});
+    }
+}
+
+void XmlJournal::Removing(pugi::xml_node node)
+{
+    if (!node) {
+        return;
+    }
+
+    Entry entry{Remove, node.parent(), node.previous_sibling(), saved_.append_copy(node), {}};
+    Visit(node, [&entry](pugi::xml_node removed) { entry.removed.push_back(removed.internal_object()); });
+    entries_.emplace_back(std::move(entry));
+}
+
+void XmlJournal::Changing(pugi::xml_node node)
+{
+    if (!node) {
+        return;
+    }
+
+    pugi::xml_node saved;
+    if (node.type() == pugi::node_element) {
+        saved = saved_.append_child(node.name());
+        for (auto attribute : node.attributes()) {
+            saved.append_attribute(attribute.name()).set_value(attribute.value());
+        }
+    }
+    else {
+        saved = saved_.append_copy(node);
+    }
+    entries_.push_back({Change, node, {}, saved, {}});
+}
+
+pugi::xml_node XmlJournal::Resolve(pugi::xml_node node) const
+{
+    auto it = restored_.find(node.internal_object());
+    return it != restored_.end() ? it->second : node;
+}
+
+void XmlJournal::Rollback(size_t mark)
+{
+    const auto doc   = doc_.lock();
+    const auto index = doc ? XmlIndex::Get(doc, false) : nullptr;
+
+    while (entries_.size() > mark) {
+        auto& entry = entries_.back();
+        auto  node  = Resolve(entry.node);
+        switch (entry.type) {
+        case Insert: {
+            auto parent = node.parent();
+            if (index) {
+                index->Remove(node);
+            }
+            parent.remove_child(node);
+            if (index) {
+                index->Update(parent);
+            }
+            break;
+        }
+        case Remove: {
+            auto previous = Resolve(entry.previous);
+            auto restored = previous ? node.insert_copy_after(entry.saved, previous) : node.prepend_copy(entry.saved);
+            size_t i = 0;
+            Visit(restored, [this, &entry, &i](pugi::xml_node copy) { restored_[entry.removed[i++]] = copy; });
+            if (index) {
+                index->Insert(restored);
+            }
+            break;
+        }
+        case Change:
+            if (node.type() == pugi::node_element) {
+                while (auto attribute = node.first_attribute()) {
+                    node.remove_attribute(attribute);
+                }
+                for (auto attribute : entry.saved.attributes()) {
+                    node.append_attribute(attribute.name()).set_value(attribute.value());
+                }
+            }
+            else {
+                node.set_value(entry.saved.value());
+            }
+            if (index) {
+                index->Update(node);
+            }
+            break;
+        }
+
+        if (entry.saved) {
+            saved_.remove_child(entry.saved);
+        }
+        entries_.pop_back();
+    }
+
+    // Older entries refer to the removed originals, point them to the restored copies instead.
+    // Before a node was removed, its address may have belonged to an even older node.
+    for (auto it = entries_.rbegin(); it != entries_.rend() && !restored_.empty(); ++it) {
+        if (it->type == Remove) {
+            for (auto removed : it->removed) {
+                restored_.erase(removed);
+            }
+        }
+        it->node     = Resolve(it->node);
+        it->previous = Resolve(it->previous);
+    }
+    restored_.clear();
+}
+
+}
@@ -0,0 +1,434 @@
+#include "xml_lazy_document.h"
+#include "xml_access_log.h"
+#include "xml_arena.h"
+#include "xml_document_state.h"
+#include "xml_escape.h"
+#include "xml_index.h"
+#include "xml_printer.h"
+
+#include "spdlog/spdlog.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <string_view>
+
+namespace xmlops {
+
+#ifndef _WIN32
+static int strnicmp(const char* a, const char* b, size_t size)
+{
+    return strncasecmp(a, b, size);
+}
+#endif
+
+// element names are compared like XmlIndex does
+static bool SameName(std::string_view a, std::string_view b)
+{
+    return a.size() == b.size() && strnicmp(a.data(), b.data(), a.size()) == 0;
+}
+
+static std::vector<std::string_view> SplitPath(std::string_view path)
+{
+    std::vector<std::string_view> steps;
+    while (!path.empty()) {
+        const auto end = path.find('/');
+        steps.push_back(path.substr(0, end));
+        path = end == std::string_view::npos ? std::string_view{} : path.substr(end + 1);
+    }
+    return steps;
+}
+
+XmlLazyDocument::XmlLazyDocument(std::weak_ptr<pugi::xml_document> doc)
+    : doc_(std::move(doc))
+{
+}
+
+std::shared_ptr<pugi::xml_document> XmlLazyDocument::Load(std::string content, pugi::xml_parse_result& result)
+{
+    auto doc  = XmlArena::MakeDocument();
+    auto lazy = std::make_shared<XmlLazyDocument>(doc);
+    lazy->content_ = std::move(content);
+    lazy->Scan();
+
+    XmlArena::Scope arena{doc};
+    if (lazy->ranges_.empty()) {
+        result = doc->load_buffer(lazy->content_.data(), lazy->content_.size());
+        return doc;
+    }
+
+    // placeholders are marked, the content may have empty assets of its own
+    const auto element     = (*XmlIndex::GetRules())[XmlIndex::ASSET_RULE].element;
+    const auto placeholder = "<" + element + " " + PLACEHOLDER_ATTRIBUTE + "=\"\"/>";
+    size_t     size        = lazy->content_.size();
+    for (const auto& range : lazy->ranges_) {
+        size = size - (range.end - range.begin) + placeholder.size();
+    }
+
+    // built in a buffer owned by the document, pugixml parses it in place instead of keeping a copy
+    const auto skeleton = static_cast<char*>(pugi::get_memory_allocation_function()(size));
+    if (!skeleton) {
+        result = doc->load_buffer(lazy->content_.data(), lazy->content_.size());
+        return doc;
+    }
+    char*  out    = skeleton;
+    size_t copied = 0;
+    for (const auto& range : lazy->ranges_) {
+        out = std::copy(lazy->content_.data() + copied, lazy->content_.data() + range.begin, out);
+        out = std::copy(placeholder.begin(), placeholder.end(), out);
+        copied = range.end;
+    }
+    std::copy(lazy->content_.data() + copied, lazy->content_.data() + lazy->content_.size(), out);
+
+    result = doc->load_buffer_inplace_own(skeleton, size);
+    if (!result) {
+        // report errors with offsets of the real content
+        result = doc->load_buffer(lazy->content_.data(), lazy->content_.size());
+        return doc;
+    }
+
+    size_t next = 0;
+    for (auto node = doc->first_child(); node;) {
+        if (node.type() == pugi::node_element && node.attribute(PLACEHOLDER_ATTRIBUTE)) {
+            if (next < lazy->ranges_.size()) {
+                lazy->ranges_[next].placeholder = node;
+                lazy->placeholders_[node.internal_object()] = next;
+            }
+            next++;
+        }
+        // next in document order, placeholders have no children
+        if (node.first_child()) {
+            node = node.first_child();
+            continue;
+        }
+        while (node && !node.next_sibling()) {
+            node = node.parent();
+        }
+        node = node ? node.next_sibling() : node;
+    }
+    if (next != lazy->ranges_.size()) {
+        result = doc->load_buffer(lazy->content_.data(), lazy->content_.size());
+        return doc;
+    }
+
+    lazy->pending_ = lazy->ranges_.size();
+    XmlDocumentState::Emplace(XmlDocumentState::Lazy, doc, lazy);
+    return doc;
+}
+
+std::shared_ptr<XmlLazyDocument> XmlLazyDocument::Get(const std::shared_ptr<pugi::xml_document>& doc)
+{
+    return XmlDocumentState::Get<XmlLazyDocument>(XmlDocumentState::Lazy, doc);
+}
+
+// Tags are found by their angle brackets, skipping comments, CDATA, processing instructions and
+// quoted attribute values. Assets whose key needs more than that, like entities, are parsed as usual.
+void XmlLazyDocument::Scan()
+{
+    const auto& rule      = (*XmlIndex::GetRules())[XmlIndex::ASSET_RULE];
+    const auto  key_steps = SplitPath(rule.key_path);
+    const auto  npos      = std::string::npos;
+
+    size_t      depth       = 0;
+    size_t      range_depth = npos;
+    size_t      range_begin = 0;
+    // key steps entered, like pugi::xml_node::child only the first child of each name counts
+    size_t      matched     = 0;
+    bool        key_done    = false;
+    std::string key;
+
+    for (size_t pos = content_.find('<'); pos != npos; pos = content_.find('<', pos)) {
+        const std::string_view rest{content_.data() + pos, content_.size() - pos};
+        const auto skip = [&](const char* end) {
+            const auto found = content_.find(end, pos);
+            return found == npos ? npos : found + strlen(end);
+        };
+        if (rest.substr(0, 4) == "<!--") {
+            pos = skip("-->");
+            continue;
+        }
+        if (rest.substr(0, 9) == "<![CDATA[") {
+            // text of a key
+            key_done = key_done || matched > 0;
+            pos      = skip("]]>");
+            continue;
+        }
+        if (rest.substr(0, 2) == "<?") {
+            pos = skip("?>");
+            continue;
+        }
+        if (rest.substr(0, 2) == "<!") {
+            pos = skip(">");
+            continue;
+        }
+
+        if (rest.substr(0, 2) == "</") {
+            const auto end = content_.find('>', pos);
+            if (end == npos || depth == 0) {
+                ranges_.clear();
+                keys_.clear();
+                return;
+            }
+            depth--;
+            if (range_depth != npos && matched > 0 && depth == range_depth + matched) {
+                key_done = true;
+            }
+            if (depth == range_depth) {
+                if (!key.empty()) {
+                    keys_[key].push_back(ranges_.size());
+                    ranges_.push_back({range_begin, end + 1, {}});
+                }
+                range_depth = npos;
+            }
+            pos = end + 1;
+            continue;
+        }
+
+        // start tag, attribute values may contain '>'
+        size_t end = pos + 1;
+        char   quote = 0;
+        for (; end < content_.size() && (quote || content_[end] != '>'); end++) {
+            if (quote && content_[end] == quote) {
+                quote = 0;
+            }
+            else if (!quote && (content_[end] == '"' || content_[end] == '\'')) {
+                quote = content_[end];
+            }
+        }
+        if (end == content_.size()) {
+            ranges_.clear();
+            keys_.clear();
+            return;
+        }
+        size_t name_end = pos + 1;
+        while (name_end < end && !isspace(static_cast<unsigned char>(content_[name_end])) &&
+               content_[name_end] != '/') {
+            name_end++;
+        }
+        const std::string_view name{content_.data() + pos + 1, name_end - pos - 1};
+        const bool             empty = content_[end - 1] == '/';
+
+        if (range_depth == npos) {
+            if (!empty && SameName(name, rule.element)) {
+                range_depth = depth;
+                range_begin = pos;
+                matched     = 0;
+                key_done    = false;
+                key.clear();
+            }
+        }
+        else if (!key_done && depth == range_depth + 1 + matched && SameName(name, key_steps[matched])) {
+            if (empty) {
+                key_done = true;
+            }
+            else if (++matched == key_steps.size()) {
+                // the key is the text up to the next tag, anything unusual leaves the asset to the parser
+                const auto text_end = content_.find('<', end + 1);
+                const auto text     = content_.substr(end + 1, text_end == npos ? npos : text_end - end - 1);
+                if (text_end != npos && content_.compare(text_end, 2, "</") == 0 &&
+                    text.find('&') == npos) {
+                    key = text;
+                }
+                key_done = true;
+            }
+        }
+
+        depth += empty ? 0 : 1;
+        pos = end + 1;
+    }
+}
+
+bool XmlLazyDocument::Avoids(const std::string& path)
+{
+    // only child steps by name from the top, predicates may look at the string value of placeholders
+    if (path.size() < 2 || path[0] != '/') {
+        return false;
+    }
+
+    const auto& element = (*XmlIndex::GetRules())[XmlIndex::ASSET_RULE].element;
+    for (const auto step : SplitPath(std::string_view{path}.substr(1))) {
+        if (step.empty() || (!isalpha(static_cast<unsigned char>(step[0])) && step[0] != '_')) {
+            return false;
+        }
+        for (const auto c : step) {
+            if (!isalnum(static_cast<unsigned char>(c)) && !strchr("_-.", c)) {
+                return false;
+            }
+        }
+        if (SameName(step, element)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void XmlLazyDocument::Materialize(const XmlAccessSet& reads)
+{
+    if (pending_ == 0 || reads.empty()) {
+        return;
+    }
+    if (reads.all) {
+        MaterializeAll();
+        return;
+    }
+
+    auto doc = doc_.lock();
+    if (!doc) {
+        return;
+    }
+    std::shared_ptr<XmlIndex> index;
+    for (const auto& [rule, key] : reads.keys) {
+        if (rule == XmlIndex::ASSET_RULE) {
+            if (auto it = keys_.find(key); it != keys_.end()) {
+                for (auto range : it->second) {
+                    Materialize(doc, range, XmlIndex::Get(doc, false).get());
+                }
+                continue;
+            }
+        }
+        index = index ? index : XmlIndex::Get(doc);
+        if (!index->Find(rule, key)) {
+            MaterializeAll();
+            return;
+        }
+    }
+}
+
+void XmlLazyDocument::MaterializeAll()
+{
+    auto doc = doc_.lock();
+    if (!doc || pending_ == 0) {
+        return;
+    }
+
+    const auto index = XmlIndex::Get(doc, false);
+    for (size_t i = 0; i < ranges_.size() && pending_ > 0; i++) {
+        Materialize(doc, i, index.get());
+    }
+    if (placeholders_.empty()) {
+        // only needed for printing pending assets
+        content_ = {};
+        keys_.clear();
+    }
+}
+
+// Placeholders are only removed by ops reading everything, which parsed all assets before.
+void XmlLazyDocument::Materialize(const std::shared_ptr<pugi::xml_document>& doc, size_t range, XmlIndex* index)
+{
+    auto& lazy = ranges_[range];
+    if (!lazy.pending) {
+        return;
+    }
+    lazy.pending = false;
+    pending_--;
+
+    auto            placeholder = lazy.placeholder;
+    auto            parent      = placeholder.parent();
+    auto            last        = parent.last_child();
+    XmlArena::Scope arena{doc};
+    const auto      result = parent.append_buffer(content_.data() + lazy.begin, lazy.end - lazy.begin);
+    if (!result) {
+        // keep the placeholder, the asset is printed as it was
+        while (parent.last_child() != last) {
+            parent.remove_child(parent.last_child());
+        }
+        spdlog::error("Failed to parse asset at offset {}: {}", lazy.begin + result.offset, result.description());
+        return;
+    }
+
+    // parsed at the end of parent, move it in place of its placeholder
+    auto asset = parent.insert_move_before(parent.last_child(), placeholder);
+
+    if (index) {
+        index->Insert(asset);
+        index->Remove(placeholder);
+    }
+    placeholders_.erase(placeholder.internal_object());
+    parent.remove_child(placeholder);
+}
+
+bool XmlLazyDocument::FindPending(pugi::xml_node node, std::unordered_map<pugi::xml_node_struct*, bool>& pending) const
+{
+    bool found = false;
+    for (auto child = node.first_child(); child; child = child.next_sibling()) {
+        if (child.type() != pugi::node_element) {
+            continue;
+        }
+        if (placeholders_.count(child.internal_object())) {
+            pending[child.internal_object()] = false;
+            found = true;
+        }
+        else if (FindPending(child, pending)) {
+            found = true;
+        }
+    }
+    if (found) {
+        pending[node.internal_object()] = true;
+    }
+    return found;
+}
+
+void XmlLazyDocument::Print(const std::shared_ptr<pugi::xml_document>& doc, pugi::xml_writer& writer)
+{
+    auto lazy = Get(doc);
+    if (!lazy || lazy->placeholders_.empty()) {
+        XmlPrinter::Print(*doc, writer, "", pugi::format_raw);
+        return;
+    }
+
+    // placeholders and, as true, the nodes containing them
+    std::unordered_map<pugi::xml_node_struct*, bool> pending;
+    lazy->FindPending(*doc, pending);
+    pugi::xml_document asset;
+    lazy->Print(*doc, pending, asset, writer);
+}
+
+void XmlLazyDocument::Print(pugi::xml_node node, const std::unordered_map<pugi::xml_node_struct*, bool>& pending,
+                            pugi::xml_document& asset, pugi::xml_writer& writer) const
+{
+    const auto it = pending.find(node.internal_object());
+    if (it == pending.end()) {
+        node.print(writer, "", pugi::format_raw);
+        return;
+    }
+    if (!it->second) {
+        // parsed for printing only, so comments, whitespace and escapes are printed like in parsed assets
+        const auto& range = ranges_[placeholders_.at(node.internal_object())];
+        if (asset.load_buffer(content_.data() + range.begin, range.end - range.begin)) {
+            asset.print(writer, "", pugi::format_raw);
+        }
+        else {
+            writer.write(content_.data() + range.begin, range.end - range.begin);
+        }
+        return;
+    }
+
+    const auto write = [&writer](std::string_view text) { writer.write(text.data(), text.size()); };
+    if (node.type() == pugi::node_element) {
+        write("<");
+        write(node.name());
+        for (auto attribute : node.attributes()) {
+            write(" ");
+            write(attribute.name());
+            write("=\"");
+            WriteEscaped(attribute.value(), true, write);
+            write("\"");
+        }
+        write(">");
+    }
+    for (auto child = node.first_child(); child; child = child.next_sibling()) {
+        Print(child, pending, asset, writer);
+    }
+    if (node.type() == pugi::node_element) {
+        write("</");
+        write(node.name());
+        write(">");
+    }
+}
+
+XmlLazyDocument::Stats XmlLazyDocument::GetStats() const
+{
+    return {ranges_.size(), ranges_.size() - pending_};
+}
+
+}
@@ -0,0 +1,125 @@
+#include "xml_line_index.h"
+#include "xml_operations.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace xmlops {
+
+static unsigned CountBits(uint32_t mask)
+{
+#ifdef _MSC_VER
+    return __popcnt(mask);
+#else
+    return __builtin_popcount(mask);
+#endif
+}
+
+static unsigned LowestBit(uint32_t mask)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+// Bit i is set if block[i] is a newline.
+#if defined(__AVX2__)
+static constexpr size_t BLOCK_SIZE = 32;
+
+static uint32_t NewlineMask(const char* block)
+{
+    const auto chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block));
+    return static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('\n'))));
+}
+#elif defined(__SSE2__) || defined(_M_X64)
+static constexpr size_t BLOCK_SIZE = 16;
+
+static uint32_t NewlineMask(const char* block)
+{
+    const auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block));
+    return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('\n'))));
+}
+#else
+static constexpr size_t BLOCK_SIZE = 8;
+
+static uint32_t NewlineMask(const char* block)
+{
+    uint32_t mask = 0;
+    for (size_t i = 0; i < BLOCK_SIZE; i++) {
+        mask |= static_cast<uint32_t>(block[i] == '\n') << i;
+    }
+    return mask;
+}
+#endif
+
+XmlLineIndex::XmlLineIndex(std::filesystem::path file)
+    : file_(std::move(file))
+{
+}
+
+XmlLineIndex::XmlLineIndex(std::shared_ptr<const std::vector<char>> content)
+    : content_(std::move(content))
+{
+}
+
+size_t XmlLineIndex::GetLine(ptrdiff_t offset) const
+{
+    std::call_once(built_, [this]() {
+        // pugixml parses its own copy in place, overwriting some newlines, so lines are counted in the file
+        std::vector<char> buffer;
+        size_t            size = 0;
+        if (content_) {
+            newlines_ = FindNewlines(content_->data(), content_->size());
+        }
+        else if (XmlOperationContext::ReadFile(file_, buffer, size)) {
+            newlines_ = FindNewlines(buffer.data(), buffer.size());
+        }
+        content_.reset();
+    });
+
+    auto it = std::lower_bound(newlines_.begin(), newlines_.end(), offset);
+    return (it - newlines_.begin()) + 1;
+}
+
+std::vector<ptrdiff_t> XmlLineIndex::FindNewlines(const char* buffer, size_t size)
+{
+    const size_t blocks_end = size - size % BLOCK_SIZE;
+
+    // count first, so the table is allocated exactly once
+    size_t count = 0;
+    for (size_t i = 0; i < blocks_end; i += BLOCK_SIZE) {
+        count += CountBits(NewlineMask(buffer + i));
+    }
+    count += std::count(buffer + blocks_end, buffer + size, '\n');
+
+    std::vector<ptrdiff_t> result;
+    result.reserve(count);
+    for (size_t i = 0; i < blocks_end; i += BLOCK_SIZE) {
+        for (auto mask = NewlineMask(buffer + i); mask; mask &= mask - 1) {
+            result.push_back(i + LowestBit(mask));
+        }
+    }
+    for (size_t i = blocks_end; i < size; i++) {
+        if (buffer[i] == '\n') {
+            result.push_back(i);
+        }
+    }
+    return result;
+}
+
+}
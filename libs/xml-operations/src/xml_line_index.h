@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace xmlops {
+
+/// @brief Line numbers of a file.
+///        The newline table is only built for the first message, most files never need it.
+///        Only offsets are kept, not the content next to the parsed document.
+class XmlLineIndex
+{
+public:
+    /// @param file Read again for the first line looked up.
+    explicit XmlLineIndex(std::filesystem::path file);
+    /// @param content Kept until the first line is looked up, for documents not read from a file.
+    explicit XmlLineIndex(std::shared_ptr<const std::vector<char>> content);
+
+    /// @returns 1-based line of a byte offset.
+    size_t GetLine(ptrdiff_t offset) const;
+
+    /// @brief Offsets of all newlines in buffer, in order.
+    static std::vector<ptrdiff_t> FindNewlines(const char* buffer, size_t size);
+
+private:
+    std::filesystem::path                            file_;
+    mutable std::shared_ptr<const std::vector<char>> content_;
+    mutable std::once_flag                           built_;
+    mutable std::vector<ptrdiff_t>                   newlines_;
+};
+
+}
@@ -0,0 +1,199 @@
+#include "xml_memory.h"
+
+#include "spdlog/spdlog.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace xmlops {
+
+using Stage   = XmlMemory::Stage;
+using Counter = XmlMemory::Counter;
+
+struct Owner {
+    size_t   size;
+    Stage    stage;
+    Counter* name;
+};
+
+static std::mutex                                            memory_mutex;
+static Counter                                               total;
+static std::array<Counter, static_cast<size_t>(Stage::Count)> stages;
+// map nodes don't move, scopes and owners point to them
+static std::map<std::string, Counter>           named;
+static std::unordered_map<const void*, Owner>   owners;
+static std::atomic<bool>                        counting_blocks = false;
+static thread_local Stage                       current_stage = Stage::None;
+static thread_local Counter*                    current_name  = nullptr;
+
+static void Increase(Counter& counter, size_t bytes)
+{
+    counter.current += bytes;
+    counter.total += bytes;
+    counter.peak = std::max(counter.peak, counter.current);
+}
+
+static void Decrease(Counter& counter, size_t bytes)
+{
+    counter.current -= std::min(counter.current, bytes);
+}
+
+static Counter& GetStageCounter(Stage stage)
+{
+    return stages[static_cast<size_t>(stage)];
+}
+
+XmlMemory::Scope::Scope(Stage stage, const std::string& name)
+    : previous_stage_(current_stage), previous_name_(current_name)
+{
+    current_stage = stage;
+    if (!name.empty()) {
+        std::scoped_lock lock{memory_mutex};
+        current_name = &named[name];
+    }
+}
+
+XmlMemory::Scope::~Scope()
+{
+    current_stage = previous_stage_;
+    current_name  = previous_name_;
+}
+
+void XmlMemory::Add(Stage stage, const std::string& name, size_t bytes)
+{
+    std::scoped_lock lock{memory_mutex};
+    Increase(total, bytes);
+    Increase(GetStageCounter(stage), bytes);
+    if (!name.empty()) {
+        Increase(named[name], bytes);
+    }
+}
+
+void XmlMemory::Remove(Stage stage, const std::string& name, size_t bytes)
+{
+    std::scoped_lock lock{memory_mutex};
+    Decrease(total, bytes);
+    Decrease(GetStageCounter(stage), bytes);
+    if (auto it = named.find(name); it != named.end()) {
+        Decrease(it->second, bytes);
+    }
+}
+
+XmlMemory::Usage::Usage(Stage stage, std::string name, size_t bytes)
+    : stage_(stage), name_(std::move(name))
+{
+    Add(bytes);
+}
+
+XmlMemory::Usage::~Usage()
+{
+    XmlMemory::Remove(stage_, name_, bytes_);
+}
+
+void XmlMemory::Usage::Add(size_t bytes)
+{
+    XmlMemory::Add(stage_, name_, bytes);
+    bytes_ += bytes;
+}
+
+void XmlMemory::CountBlocks(bool enable)
+{
+    counting_blocks = enable;
+}
+
+bool XmlMemory::IsCountingBlocks()
+{
+    return counting_blocks.load(std::memory_order_relaxed);
+}
+
+void XmlMemory::Allocated(const void* block, size_t size)
+{
+    std::scoped_lock lock{memory_mutex};
+    Increase(total, size);
+    Increase(GetStageCounter(current_stage), size);
+    if (current_name) {
+        Increase(*current_name, size);
+    }
+    owners[block] = {size, current_stage, current_name};
+}
+
+void XmlMemory::Freed(const void* block)
+{
+    std::scoped_lock lock{memory_mutex};
+    auto it = owners.find(block);
+    // allocated before counting started
+    if (it == owners.end()) {
+        return;
+    }
+
+    Decrease(total, it->second.size);
+    Decrease(GetStageCounter(it->second.stage), it->second.size);
+    if (it->second.name) {
+        Decrease(*it->second.name, it->second.size);
+    }
+    owners.erase(it);
+}
+
+Counter XmlMemory::GetTotal()
+{
+    std::scoped_lock lock{memory_mutex};
+    return total;
+}
+
+Counter XmlMemory::GetStage(Stage stage)
+{
+    std::scoped_lock lock{memory_mutex};
+    return GetStageCounter(stage);
+}
+
+std::map<std::string, Counter> XmlMemory::GetNamed()
+{
+    std::scoped_lock lock{memory_mutex};
+    return named;
+}
+
+const char* XmlMemory::GetStageName(Stage stage)
+{
+    switch (stage) {
+    case Stage::Read: return "read";
+    case Stage::Parse: return "parse";
+    case Stage::Apply: return "apply";
+    case Stage::Serialize: return "serialize";
+    case Stage::Compress: return "compress";
+    default: return "other";
+    }
+}
+
+void XmlMemory::LogStats(size_t names)
+{
+    if (!spdlog::should_log(spdlog::level::debug)) {
+        return;
+    }
+
+    constexpr double MB = 1024.0 * 1024.0;
+    const auto total = GetTotal();
+    spdlog::debug("Memory: {:.1f} MB current, {:.1f} MB peak", total.current / MB, total.peak / MB);
+    for (size_t i = 0; i < static_cast<size_t>(Stage::Count); i++) {
+        const auto stage   = static_cast<Stage>(i);
+        const auto counter = GetStage(stage);
+        if (counter.total > 0) {
+            spdlog::debug("Memory {}: {:.1f} MB current, {:.1f} MB peak", GetStageName(stage),
+                          counter.current / MB, counter.peak / MB);
+        }
+    }
+
+    const auto all = GetNamed();
+    std::vector<std::pair<std::string, Counter>> sorted(all.begin(), all.end());
+    std::sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b) { return a.second.peak > b.second.peak; });
+    for (size_t i = 0; i < std::min(names, sorted.size()); i++) {
+        spdlog::debug("Memory {}: {:.1f} MB current, {:.1f} MB peak", sorted[i].first,
+                      sorted[i].second.current / MB, sorted[i].second.peak / MB);
+    }
+}
+
+}
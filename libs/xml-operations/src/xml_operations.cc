@@ -1,12 +1,30 @@
 #include "xml_operations.h"
+#include "xml_access_log.h"
+#include "xml_arena.h"
+#include "xml_index.h"
+#include "xml_journal.h"
+#include "xml_lazy_document.h"
+#include "xml_line_index.h"
+#include "xml_memory.h"
+#include "xml_simple_path.h"
+#include "xml_thread_pool.h"
 
 #include "spdlog/spdlog.h"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <cstdio>
 #include <cstring>
+#include <deque>
 #include <fstream>
 #include <map>
+#include <mutex>
 #include <regex>
+#include <thread>
+#include <unordered_set>
 
 namespace xmlops {
 
@@ -42,19 +60,21 @@ XmlOperationContext::XmlOperationContext(const fs::path& mod_relative_path,
         mod_name = mod_base_path.filename().string();
     }
 
-    include_loader_ = [this, &mod_base_path, &mod_name](const fs::path& file_path) {
-        std::vector<char> buffer;
-        size_t size;
-        if (!ReadFile(mod_base_path / file_path, buffer, size)) {
+    const auto load = [this, mod_base_path, mod_name](const fs::path& file_path, bool include) {
+        auto context = include ? LoadInclude(mod_base_path / file_path, file_path, mod_name, *this->include_loader_)
+                               : LoadFile(mod_base_path / file_path, file_path, mod_name, *this->include_loader_);
+        if (!context) {
             spdlog::error("{}: Failed to open {}",
                           mod_name,
                           file_path.string());
             return std::make_shared<XmlOperationContext>();
         }
-        return std::make_shared<XmlOperationContext>(buffer.data(), size, file_path, mod_name, *this->include_loader_);
+        return context;
     };
+    // includes are opened when applied, long after this constructor
+    include_loader_ = [load](const fs::path& file_path) { return load(file_path, true); };
 
-    *this = *(*include_loader_)(mod_relative_path);
+    *this = *load(mod_relative_path, false);
     mod_name_ = mod_name;
 }
 
@@ -66,16 +86,126 @@ XmlOperationContext::XmlOperationContext(const char* buffer, size_t size,
     mod_name_ = mod_name;
     include_loader_ = include_loader;
     doc_path_ = doc_path.generic_string();
+    auto content = std::make_shared<const std::vector<char>>(buffer, buffer + size);
+    Parse(*content, std::make_shared<XmlLineIndex>(content));
+}
 
-    offset_data_ = BuildOffsetData(buffer, size);
-    doc_ = std::make_shared<pugi::xml_document>();
-    auto parse_result = doc_->load_buffer(buffer, size);
+bool XmlOperationContext::Parse(const std::vector<char>& content, std::shared_ptr<const XmlLineIndex> lines)
+{
+    lines_ = std::move(lines);
+    doc_ = XmlArena::MakeDocument();
+    pugi::xml_parse_result parse_result;
+    {
+        XmlMemory::Scope memory{XmlMemory::Stage::Parse, doc_path_};
+        XmlArena::Scope  arena{doc_};
+        parse_result = doc_->load_buffer(content.data(), content.size());
+    }
     if (!parse_result) {
         const auto line = this->GetLine(parse_result.offset);
         const auto desc = parse_result.description();
         spdlog::error("{}: Failed to parse: {} ({}:{})",
-                      mod_name, desc, doc_path_, line);
+                      mod_name_, desc, doc_path_, line);
+        return false;
+    }
+    return true;
+}
+
+// Parsed includes by resolved path, only the latest content is kept.
+// Owned by the passes using it, so documents never outlive the arenas they are allocated from.
+struct CachedFile {
+    size_t                              size = 0;
+    size_t                              hash = 0;
+    std::shared_ptr<pugi::xml_document> doc;
+    std::shared_ptr<const XmlLineIndex> lines;
+};
+using FileCache = std::unordered_map<std::string, CachedFile>;
+static std::mutex                             file_cache_mutex;
+static std::weak_ptr<FileCache>               file_cache;
+static XmlOperationContext::IncludeCacheStats file_cache_stats;
+
+XmlOperationContext::IncludeCachePass::IncludeCachePass()
+{
+    std::scoped_lock lock{file_cache_mutex};
+    auto cache = file_cache.lock();
+    if (!cache) {
+        cache      = std::make_shared<FileCache>();
+        file_cache = cache;
+    }
+    cache_ = cache;
+}
+
+std::shared_ptr<XmlOperationContext> XmlOperationContext::LoadFile(const fs::path& file_path,
+                                                                   const fs::path& doc_path,
+                                                                   const std::string& mod_name,
+                                                                   std::optional<include_loader_t> include_loader)
+{
+    std::vector<char> buffer;
+    size_t size;
+    if (!ReadFile(file_path, buffer, size)) {
+        return {};
+    }
+
+    auto context = std::make_shared<XmlOperationContext>();
+    context->mod_name_ = mod_name;
+    context->include_loader_ = include_loader;
+    context->doc_path_ = doc_path.generic_string();
+    // line numbers are only looked up for messages, the file is read again for them
+    context->Parse(buffer, std::make_shared<XmlLineIndex>(file_path));
+    return context;
+}
+
+std::shared_ptr<XmlOperationContext> XmlOperationContext::LoadInclude(const fs::path& file_path,
+                                                                      const fs::path& doc_path,
+                                                                      const std::string& mod_name,
+                                                                      std::optional<include_loader_t> include_loader)
+{
+    std::shared_ptr<FileCache> cache;
+    {
+        std::scoped_lock lock{file_cache_mutex};
+        cache = file_cache.lock();
+    }
+    if (!cache) {
+        return LoadFile(file_path, doc_path, mod_name, include_loader);
+    }
+
+    std::vector<char> buffer;
+    size_t size;
+    if (!ReadFile(file_path, buffer, size)) {
+        return {};
+    }
+
+    auto context = std::make_shared<XmlOperationContext>();
+    context->mod_name_ = mod_name;
+    context->include_loader_ = include_loader;
+    context->doc_path_ = doc_path.generic_string();
+
+    // documents are only read after parsing, so they can be shared
+    const auto key  = file_path.lexically_normal().generic_string();
+    const auto hash = std::hash<std::string_view>{}(std::string_view{buffer.data(), buffer.size()});
+    {
+        std::scoped_lock lock{file_cache_mutex};
+        if (auto it = cache->find(key);
+            it != cache->end() && it->second.size == buffer.size() && it->second.hash == hash) {
+            file_cache_stats.hits++;
+            context->doc_ = it->second.doc;
+            context->lines_ = it->second.lines;
+            return context;
+        }
+        file_cache_stats.misses++;
+    }
+
+    // files which fail to parse are not cached, so the error is reported for every include
+    if (context->Parse(buffer, std::make_shared<XmlLineIndex>(file_path))) {
+        std::scoped_lock lock{file_cache_mutex};
+        (*cache)[key] = {buffer.size(), hash, context->doc_, context->lines_};
     }
+    return context;
+}
+
+XmlOperationContext::IncludeCacheStats XmlOperationContext::GetIncludeCacheStats()
+{
+    std::scoped_lock lock{file_cache_mutex};
+    return file_cache_stats;
 }
 
 std::shared_ptr<XmlOperationContext> XmlOperationContext::OpenInclude(const fs::path& file_path) const
@@ -92,8 +222,7 @@ std::shared_ptr<XmlOperationContext> XmlOperationContext::OpenInclude(const fs::
 
 size_t XmlOperationContext::GetLine(ptrdiff_t offset) const
 {
-    auto it = std::lower_bound(offset_data_.begin(), offset_data_.end(), offset);
-    return (it - offset_data_.begin()) + 1;
+    return lines_ ? lines_->GetLine(offset) : 1;
 }
 
 pugi::xml_node XmlOperationContext::GetRoot() const
@@ -124,6 +253,9 @@ void XmlOperationContext::Debug(std::string_view msg, const Args &... args) cons
 
 void XmlOperationContext::Debug(std::string_view msg, pugi::xml_node node) const
 {
+    if (!spdlog::should_log(spdlog::level::debug)) {
+        return;
+    }
     spdlog::debug("{}: {} ({}:{})", mod_name_, msg, doc_path_, node ? GetLine(node) : 0);
 }
 
@@ -151,15 +283,34 @@ bool XmlOperationContext::ReadFile(const fs::path& file_path, std::vector<char>&
     return true;
 }
 
-XmlOperationContext::offset_data_t XmlOperationContext::BuildOffsetData(const char* buffer, size_t size)
+std::shared_ptr<const pugi::xpath_query> XmlOperationContext::CompileQuery(const std::string& path,
+                                                                        pugi::xml_node node) const
 {
-    offset_data_t result;
-    for (size_t i = 0; i < size; ++i) {
-        if (buffer[i] == '\n') {
-            result.push_back(i);
+    auto [it, inserted] = queries_.try_emplace(path);
+    auto& compiled = it->second;
+    if (inserted) {
+        try {
+            auto query = std::make_shared<pugi::xpath_query>(path.c_str());
+            if (query->return_type() == pugi::xpath_type_node_set) {
+                compiled.query = query;
+            } else {
+                compiled.error = "Expression does not evaluate to node set";
+            }
+        } catch (const pugi::xpath_exception& e) {
+            compiled.error = e.what();
         }
     }
-    return result;
+
+    // report every ModOp using the path, not only the first one
+    if (!compiled.query) {
+        Error("Failed to parse path \"" + path + "\": " + compiled.error, node);
+    }
+    return compiled.query;
+}
+
+static std::string GetGuidPath(const std::string& guid)
+{
+    return "//Asset[Values/Standard/GUID='" + guid + "']";
 }
 
 XmlLookup::XmlLookup() { }
@@ -186,51 +337,143 @@ XmlLookup::XmlLookup(const std::string& path,
     }
     else if (!read_path.empty() && read_path[0]== '~') {
         read_path = read_path.substr(1);
-        guid_ = guid;
-        template_ = templ;
     }
     else if (explicit_speculative) {
-        if (!read_path.empty() && read_path.length() >= 2 && read_path[0] == '/' && read_path[1] != '/') {
-            guid_ = guid;
-            template_ = templ;
+        if (read_path.length() < 2 || read_path[0] != '/' || read_path[1] == '/') {
+            ReadPath(read_path, {}, {});
+            Compile();
+            return;
         }
-        else {
-            guid_ = {};
-            template_ = {};
+    }
+
+    ReadPath(read_path, guid, templ);
+    Compile();
+}
+
+// Relative paths that only look at the context node and its descendants.
+// Anything that may be absolute or go upwards is rejected, even if it's only inside a string.
+static bool IsSubtreeLocal(const std::string& path)
+{
+    if (path == "self::node()") {
+        return true;
+    }
+    if (path.empty() || path.find("..") != std::string::npos || path.find("::") != std::string::npos ||
+        path.find('$') != std::string::npos || path.find("id(") != std::string::npos ||
+        path.find("lang(") != std::string::npos) {
+        return false;
+    }
+
+    char previous = 0;
+    for (const char c : path) {
+        // a slash not following a step starts an absolute path, e.g. in [Product=/Root/Product]
+        const bool after_step = previous != 0 && (isalnum(static_cast<unsigned char>(previous)) ||
+                                                  strchr("_-.*])/", previous) != nullptr);
+        if (c == '/' && !after_step) {
+            return false;
+        }
+        if (c != ' ') {
+            previous = c;
         }
     }
+    return true;
+}
+
+void XmlLookup::Compile()
+{
+    // compile once, all GUID expansions of a ModOp share the same queries
+    query_ = context_->CompileQuery(path_, node_);
+    if (!query_) {
+        branches_.clear();
+        return;
+    }
+    simple_path_ = XmlSimplePath::Parse(path_);
+
+    for (auto& branch : branches_) {
+        branch.query = context_->CompileQuery(branch.path, node_);
+        if (branch.query) {
+            branch.simple_path = XmlSimplePath::Parse(branch.path);
+        }
+        branch.memoize = branch.keys.empty() || IsSubtreeLocal(branch.path);
+    }
+}
+
+pugi::xpath_node_set XmlLookup::Evaluate(XmlIndex* index, pugi::xml_node node, const std::string& path,
+                                         const pugi::xpath_query& query,
+                                         const XmlSimplePath* simple_path) const
+{
+    if (index) {
+        if (auto memo = index->GetMemo(node, path)) {
+            return *memo;
+        }
+    }
+
+    pugi::xpath_node_set results;
+    if (!simple_path) {
+        results = node.select_nodes(query);
+    }
     else {
-        guid_ = guid;
-        template_ = templ;
+        results = simple_path->Select(node);
+#ifndef NDEBUG
+        auto expected = node.select_nodes(query);
+        if (expected.size() != results.size() ||
+            !std::equal(expected.begin(), expected.end(), results.begin())) {
+            context_->Error("Simple path evaluation differs from XPath: \"" + path + "\"", node_);
+            results = expected;
+        }
+#endif
     }
 
-    ReadPath(read_path, guid_, template_);
+    if (index) {
+        index->SetMemo(node, path, results);
+    }
+    return results;
 }
 
-pugi::xpath_node_set XmlLookup::Select(std::shared_ptr<pugi::xml_document> doc, std::optional<pugi::xml_node>* assetNode, bool strict) const
+pugi::xpath_node_set XmlLookup::Select(std::shared_ptr<pugi::xml_document> doc, std::optional<pugi::xml_node>* assetNode,
+                                       const std::string* guid) const
 {
+    if (guid && (guid_.empty() || *guid == guid_)) {
+        guid = nullptr;
+    }
+
     try {
-        auto results = ReadGuidNodes(doc, assetNode);
-        if (!results.empty() || (strict && !guid_.empty())) {
-            return results;
+        if (assetNode) {
+            *assetNode = {};
         }
-
-        results = ReadTemplateNodes(doc);
-        if (!results.empty() || (strict && !template_.empty())) {
-            return results;
+        if (!branches_.empty() && (!guid || guid_branch_)) {
+            bool complete = true;
+            if (auto results = SelectBranches(doc, assetNode, guid, complete)) {
+                if (!results->empty() || complete) {
+                    return *results;
+                }
+                context_->Debug("Speculative path failed to find node with path {}", path_);
+            }
         }
 
-        if (!guid_.empty() || !template_.empty()) {
-            context_->Debug("Speculative path failed to find node with path {} {}", path_, speculative_path_);
+        // invalid paths have been reported when loading
+        if (!query_) {
+            return {};
+        }
+        if (guid) {
+            // only if the index misses a GUID of a batched op
+            return doc->select_nodes(GetPath(guid).c_str());
         }
-        return doc->select_nodes(path_.c_str());
+        return Evaluate(XmlIndex::Get(doc).get(), *doc, path_, *query_, simple_path_.get());
     } catch (const pugi::xpath_exception &e) {
-        context_->Error("Failed to parse path \"" + path_ + "\": " + e.what(), node_);
+        context_->Error("Failed to parse path \"" + GetPath(guid) + "\": " + e.what(), node_);
     }
 
     return {};
 }
 
+std::string XmlLookup::GetPath(const std::string* guid) const
+{
+    if (!guid || guid_.empty()) {
+        return path_;
+    }
+    return GetGuidPath(*guid) + path_.substr(GetGuidPath(guid_).size());
+}
+
 XmlOperation::XmlOperation(std::shared_ptr<XmlOperationContext> doc, pugi::xml_node node,
                            const std::string& guid, const std::string& templ) : doc_(doc)
 {
@@ -247,6 +490,9 @@ XmlOperation::XmlOperation(std::shared_ptr<XmlOperationContext> doc, pugi::xml_n
 
     if (type_ != Type::Remove) {
         content_ = XmlLookup{node.attribute("Content").as_string(), guid, templ, true, doc, node};
+        if (!content_.IsEmpty()) {
+            ReadContentPlaceholders();
+        }
     }
 }
 
@@ -258,80 +504,29 @@ void XmlLookup::ReadPath(std::string prop_path, std::string guid, std::string te
         prop_path = std::regex_replace(prop_path, std::regex{"&lt;"}, "<");
     }
 
-    if (guid.empty()) {
-        // Rewrite path to use faster GUID lookup
-        int g;
-        // Matches stuff like this and extracts GUID //Assets[Asset/Values/Standard/GUID='102119']
-        if (sscanf(prop_path.c_str(), "@%d", &g) > 0) {
-            const auto match = std::string("@") + std::to_string(g);
-            if (prop_path.rfind(match, 0) == 0) {
-                guid = std::to_string(g);
-                guid_ = std::to_string(g);
-                speculative_path_type_ = SpeculativePathType::VALUES_CONTAINER;
-                prop_path = prop_path.substr(match.length());
-                path_ = "//Values[Standard/GUID='" + guid + "']";
-            }
-            else {
-                context_->Warn("Failed to construct speculative path lookup: \"" + prop_path + "\"", node_);
-            }
-        }
-        else if (sscanf(prop_path.c_str(), "//Assets[Asset/Values/Standard/GUID='%d']", &g) > 0) {
-            if (std::string("//Assets[Asset/Values/Standard/GUID='") + std::to_string(g) + "']"
-                == prop_path) {
-                guid                   = std::to_string(g);
-                guid_                  = std::to_string(g);
-                speculative_path_type_ = SpeculativePathType::ASSET_CONTAINER;
-            }
-        }
-        else if (sscanf(prop_path.c_str(), "//Asset/Values[Standard/GUID='%d']", &g) > 0) {
-            const auto match = std::string("//Asset/Values[Standard/GUID='") + std::to_string(g) + "']";
-            if (prop_path.rfind(match, 0) == 0) {
-                guid = std::to_string(g);
-                guid_ = std::to_string(g);
-                speculative_path_type_ = SpeculativePathType::VALUES_CONTAINER;
-                prop_path = prop_path.substr(match.length());
-                path_ = "//Asset/Values[Standard/GUID='" + guid + "']";
-            }
-            else {
-                context_->Warn("Failed to construct speculative path lookup: \"" + prop_path + "\"", node_);
-            }
+    // GUID, Template and @GUID are turned into paths ReadBranches resolves via index lookup
+    if (!guid.empty()) {
+        guid_ = guid;
+        path_ = GetGuidPath(guid);
+    }
+    else if (!temp.empty()) {
+        path_ = "//Template[Name='" + temp + "']";
+    }
+    else if (int g; sscanf(prop_path.c_str(), "@%d", &g) > 0) {
+        const auto match = std::string("@") + std::to_string(g);
+        if (prop_path.rfind(match, 0) == 0) {
+            prop_path = prop_path.substr(match.length());
+            path_     = "//Values[Standard/GUID='" + std::to_string(g) + "']";
         }
-        else if (sscanf(prop_path.c_str(), "//Values[Standard/GUID='%d']", &g) > 0) {
-            const auto match = std::string("//Values[Standard/GUID='") + std::to_string(g) + "']";
-            if (prop_path.rfind(match, 0) == 0) {
-                guid = std::to_string(g);
-                guid_ = std::to_string(g);
-                speculative_path_type_ = SpeculativePathType::VALUES_CONTAINER;
-                prop_path = prop_path.substr(match.length());
-                path_ = "//Values[Standard/GUID='" + guid + "']";
-            }
-            else {
-                context_->Warn("Failed to construct speculative path lookup: \"" + prop_path + "\"", node_);
-            }
+        else {
+            context_->Warn("Failed to construct speculative path lookup: \"" + prop_path + "\"", node_);
         }
-    } else {
-        speculative_path_type_ = SpeculativePathType::SINGLE_ASSET;
-        path_                  = "//Asset[Values/Standard/GUID='" + guid + "']";
     }
 
     if (prop_path.empty()) {
         prop_path = "/";
     }
 
-    if (temp.empty()) {
-        char g[256];
-        if (sscanf(prop_path.c_str(), "//Template[Name='%s']", g) > 0) {
-            if (std::string("//Template[Name='" + std::string(g) + "']") == prop_path) {
-                temp                   = g;
-                template_              = g;
-                speculative_path_type_ = SpeculativePathType::TEMPLATE_CONTAINER;
-            }
-        }
-    } else {
-        speculative_path_type_ = SpeculativePathType::SINGLE_TEMPLATE;
-        path_                  = "//Template[Name='" + temp + "']";
-    }
-
     if (prop_path.find("/") != 0) {
         path_ += "/";
     }
@@ -345,28 +540,230 @@ void XmlLookup::ReadPath(std::string prop_path, std::string guid, std::string te
         }
     }
 
-    if (!guid.empty() || !temp.empty()) {
-        if (speculative_path_type_ == SpeculativePathType::ASSET_CONTAINER
-            || speculative_path_type_ == SpeculativePathType::TEMPLATE_CONTAINER) {
-            speculative_path_ = "/";
-        } else {
-            speculative_path_ += prop_path;
+    ReadBranches();
+}
+
+// Split at top-level |, e.g. `//Asset[Values/Standard/GUID='1']/Values | //Text[GUID='1']`
+static std::vector<std::string> SplitUnion(const std::string& path)
+{
+    const auto trim = [](const std::string& str) {
+        const auto begin = str.find_first_not_of(" \t\r\n");
+        if (begin == std::string::npos) {
+            return std::string{};
         }
+        return str.substr(begin, str.find_last_not_of(" \t\r\n") - begin + 1);
+    };
 
-        if (speculative_path_ == "/") {
-            speculative_path_ = "self::node()";
+    std::vector<std::string> result;
+    size_t                   start = 0;
+    int                      depth = 0;
+    char                     quote = 0;
+    for (size_t i = 0; i < path.size(); i++) {
+        const char c = path[i];
+        if (quote) {
+            quote = c == quote ? 0 : quote;
+        }
+        else if (c == '\'' || c == '"') {
+            quote = c;
+        }
+        else if (c == '[' || c == '(') {
+            depth++;
+        }
+        else if (c == ']' || c == ')') {
+            depth--;
         }
+        else if (c == '|' && depth == 0) {
+            result.emplace_back(trim(path.substr(start, i - start)));
+            start = i + 1;
+        }
+    }
+    result.emplace_back(trim(path.substr(start)));
+    return result;
+}
 
-        if (speculative_path_.length() > 0) {
-            if (speculative_path_[speculative_path_.length() - 1] == '/') {
-                speculative_path_ = speculative_path_.substr(0, speculative_path_.length() - 1);
+void XmlLookup::ReadBranches()
+{
+    bool keyed = false;
+    for (const auto& path : SplitUnion(path_)) {
+        auto& branch = branches_.emplace_back();
+        if (ReadKeyedBranch(path, branch)) {
+            keyed     = true;
+            fallback_ = fallback_ || branch.value_path.empty();
+        }
+        else {
+            branch.path = path;
+        }
+    }
+
+    // nothing to gain, use path_ as is
+    if (!keyed) {
+        branches_.clear();
+    }
+
+    // batched ops swap the GUID of this branch
+    guid_branch_ = !guid_.empty() && !branches_.empty() && branches_[0].key_rule == XmlIndex::ASSET_RULE &&
+                   branches_[0].value_path.empty() && branches_[0].keys == std::vector<std::string>{guid_};
+}
+
+bool XmlLookup::ReadKeyedBranch(const std::string& path, Branch& branch) const
+{
+    const auto is_name_char = [](char c) {
+        return isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '-' || c == '.';
+    };
+    const auto read_steps = [&path, &is_name_char](size_t& pos, std::vector<std::string>& steps) {
+        while (pos < path.size()) {
+            auto start = pos;
+            if (path[pos] == '*') {
+                pos++;
+            }
+            while (pos < path.size() && is_name_char(path[pos]) && path[start] != '*') {
+                pos++;
+            }
+            if (pos == start) {
+                return false;
             }
+            steps.emplace_back(path.substr(start, pos - start));
+            if (pos >= path.size() || path[pos] != '/') {
+                return true;
+            }
+            pos++;
+        }
+        return false;
+    };
+    const auto skip_spaces = [&path](size_t& pos) {
+        while (pos < path.size() && path[pos] == ' ') {
+            pos++;
         }
+    };
+
+    // /Step/Step[Key/Path='value' or Key/Path='value']/rest, or starting with //
+    size_t     pos      = 0;
+    const bool absolute = path.rfind("//", 0) != 0;
+    if (path.rfind("/", 0) != 0) {
+        return false;
+    }
+    pos = absolute ? 1 : 2;
 
-        if (speculative_path_.find("/") == 0) {
-            speculative_path_ = speculative_path_.substr(1);
+    std::vector<std::string> steps;
+    if (!read_steps(pos, steps) || pos >= path.size() || path[pos] != '[') {
+        return false;
+    }
+    pos++;
+
+    std::vector<std::string> key_path;
+    std::vector<std::string> values;
+    while (true) {
+        skip_spaces(pos);
+        std::vector<std::string> predicate_path;
+        if (!read_steps(pos, predicate_path) || (!key_path.empty() && predicate_path != key_path)) {
+            return false;
         }
+        key_path = predicate_path;
+
+        skip_spaces(pos);
+        if (pos >= path.size() || path[pos] != '=') {
+            return false;
+        }
+        pos++;
+        skip_spaces(pos);
+        if (pos >= path.size() || (path[pos] != '\'' && path[pos] != '"')) {
+            return false;
+        }
+        const auto value_end = path.find(path[pos], pos + 1);
+        if (value_end == std::string::npos) {
+            return false;
+        }
+        values.emplace_back(path.substr(pos + 1, value_end - pos - 1));
+        pos = value_end + 1;
+
+        skip_spaces(pos);
+        if (pos < path.size() && path[pos] == ']') {
+            pos++;
+            break;
+        }
+        if (path.compare(pos, 3, "or ") != 0) {
+            return false;
+        }
+        pos += 3;
     }
+
+    const auto rest = path.substr(pos);
+    if (!rest.empty() && rest[0] != '/') {
+        return false;
+    }
+
+    const auto& step    = steps.back();
+    const auto  rules   = XmlIndex::GetRules();
+    bool        matched = false;
+    for (size_t i = 0; i < rules->size() && !matched; i++) {
+        const auto& rule = (*rules)[i];
+        if (rule.key_type == XmlIndexRule::NUMBER &&
+            std::any_of(values.begin(), values.end(), [](const std::string& value) {
+                return value.empty() || value.find_first_not_of("0123456789") != std::string::npos;
+            })) {
+            continue;
+        }
+
+        const auto               rule_path = StrSplit(rule.key_path, '/');
+        std::vector<std::string> up;
+        std::string              down;
+        if (key_path == rule_path) {
+            // //Asset[Values/Standard/GUID='1']
+            if (step != rule.element) {
+                continue;
+            }
+        }
+        else if (key_path.size() > rule_path.size() &&
+                 std::equal(rule_path.rbegin(), rule_path.rend(), key_path.rbegin()) &&
+                 key_path[key_path.size() - rule_path.size() - 1] == rule.element) {
+            // //Assets[Asset/Values/Standard/GUID='1']
+            up.assign(key_path.rbegin() + rule_path.size(), key_path.rend());
+        }
+        else if (key_path.size() < rule_path.size() &&
+                 std::equal(key_path.rbegin(), key_path.rend(), rule_path.rbegin())) {
+            // //Values[Standard/GUID='1']
+            const size_t depth = rule_path.size() - key_path.size();
+            if (step != rule_path[depth - 1]) {
+                continue;
+            }
+            for (size_t j = 0; j < depth; j++) {
+                down += (j > 0 ? "/" : "") + rule_path[j];
+            }
+        }
+        else {
+            continue;
+        }
+
+        branch.key_rule = i;
+        branch.up       = up;
+        branch.down     = down;
+        matched         = true;
+    }
+
+    // otherwise //Item[Product='1'], which is worth a value index if used repeatedly
+    if (!matched) {
+        if (absolute || step == "*" ||
+            std::find(key_path.begin(), key_path.end(), "*") != key_path.end()) {
+            return false;
+        }
+        for (size_t j = 0; j < key_path.size(); j++) {
+            branch.value_path += (j > 0 ? "/" : "") + key_path[j];
+        }
+    }
+
+    branch.keys = values;
+    branch.ancestors.assign(steps.rbegin(), steps.rend());
+    branch.absolute = absolute;
+    if (rest.size() <= 1) {
+        branch.path = "self::node()";
+    }
+    else if (rest[1] == '/') {
+        branch.path = "." + rest;
+    }
+    else {
+        branch.path = rest.substr(1);
+    }
+    return true;
 }
 
 void XmlOperation::ReadType(pugi::xml_node node)
@@ -400,223 +797,466 @@ void XmlOperation::ReadType(pugi::xml_node node)
     }
 }
 
-std::optional<pugi::xml_node> XmlLookup::FindAsset(const std::string& guid, pugi::xml_node node, int speculate_position) const
+static bool IsNamed(pugi::xml_node node, const std::string& name)
 {
-#ifndef _WIN32
-    auto stricmp = [](auto a, auto b) { return strcasecmp(a, b); };
-#endif
+    return node.type() == pugi::node_element && (name == "*" || name == node.name());
+}
 
-    //
-    if (stricmp(node.name(), "Asset") == 0) {
-        auto values = node.child("Values");
-        if (!values) {
-            return {};
+// The index doesn't know about the path, so check the predicate step and the ones before.
+static bool IsReachable(pugi::xml_node node, const std::vector<std::string>& ancestors, bool absolute)
+{
+    for (const auto& name : ancestors) {
+        if (!IsNamed(node, name)) {
+            return false;
         }
+        node = node.parent();
+    }
+    return !absolute || node.type() == pugi::node_document;
+}
 
-        auto standard = values.child("Standard");
-        if (!standard) {
+pugi::xml_node XmlLookup::FindKeyed(const XmlIndex& index, const Branch& branch, const std::string& key) const
+{
+    auto node = index.Find(branch.key_rule, key);
+    for (const auto& name : branch.up) {
+        if (!IsNamed(node, name)) {
             return {};
         }
+        node = node.parent();
+    }
+    if (node && !branch.down.empty()) {
+        node = node.first_element_by_path(branch.down.c_str());
+    }
 
-        auto GUID = standard.child("GUID");
-        if (!GUID) {
+    return IsReachable(node, branch.ancestors, branch.absolute) ? node : pugi::xml_node{};
+}
+
+pugi::xml_node XmlLookup::FindScope(const XmlIndex& index, const std::string* guid) const
+{
+    // the keyed element itself is excluded, changing it would change its siblings
+    if (!guid_branch_ || branches_.size() != 1 || !branches_[0].query || !branches_[0].memoize ||
+        branches_[0].path == "self::node()") {
+        return {};
+    }
+    return FindKeyed(index, branches_[0], guid ? *guid : guid_);
+}
+
+pugi::xpath_node_set XmlLookup::SelectInScope(pugi::xml_node scope) const
+{
+    const auto& branch = branches_[0];
+    auto results = branch.simple_path ? branch.simple_path->Select(scope) : scope.select_nodes(*branch.query);
+    for (const auto& result : results) {
+        if (result.node() == scope) {
             return {};
         }
+    }
+    return results;
+}
 
-        if (GUID.text().get() != guid) {
-            return {};
+void XmlLookup::GetReads(const std::string* guid, bool found, XmlAccessSet& reads) const
+{
+    if (mod_id_ || empty_path_) {
+        return;
+    }
+    if (guid && (guid_.empty() || *guid == guid_)) {
+        guid = nullptr;
+    }
+    // same as Select
+    if (branches_.empty() || (guid && !guid_branch_) || (!found && fallback_)) {
+        reads.all = true;
+        return;
+    }
+
+    for (const auto& branch : branches_) {
+        if (!branch.query) {
+            continue;
         }
-        if (speculative_path_type_ == SpeculativePathType::ASSET_CONTAINER) {
-            auto parent = node.parent();
-            while (parent && stricmp(parent.name(), "Assets") != 0) {
-                parent = parent.parent();
-            }
-            if (stricmp(parent.name(), "Assets") == 0) {
-                return parent;
+        // Value lookups and paths reaching above or outside of the keyed element see more than its key.
+        // Missing keys are read as well, adding them changes the results.
+        if (branch.keys.empty() || !branch.value_path.empty() || !branch.up.empty() || !branch.memoize) {
+            reads.all = true;
+            return;
+        }
+        if (guid && &branch == &branches_.front()) {
+            reads.Add(branch.key_rule, *guid);
+            continue;
+        }
+        for (const auto& key : branch.keys) {
+            reads.Add(branch.key_rule, key);
+        }
+    }
+}
+
+std::optional<pugi::xpath_node_set> XmlLookup::SelectBranches(std::shared_ptr<pugi::xml_document> doc, std::optional<pugi::xml_node>* assetNode,
+                                                               const std::string* guid, bool& complete) const
+{
+    // most lookups have a single branch and key, only merge if needed
+    pugi::xpath_node_set          first;
+    std::vector<pugi::xpath_node> merged;
+    size_t                        sets = 0;
+    const auto add = [&first, &merged, &sets](pugi::xpath_node_set&& results) {
+        if (results.empty()) {
+            return;
+        }
+        if (sets == 0) {
+            first = std::move(results);
+        }
+        else {
+            if (sets == 1) {
+                merged.assign(first.begin(), first.end());
             }
-            return {};
-        } else if (speculative_path_type_ == SpeculativePathType::VALUES_CONTAINER) {
-            return values;
-        } else {
-            return node;
-        }
-    }
-
-    if (speculate_position == 0) {
-        // first group level
-        static std::optional<pugi::xml_node> last_search;
-        if (last_search) {
-            for (pugi::xml_node n : node.children()) {
-                if (n == last_search) {
-                    if (auto found = FindAsset(guid, n, speculate_position - 1); found) {
-                        last_search = n;
-                        return found;
-                    }
+            merged.insert(merged.end(), results.begin(), results.end());
+        }
+        sets++;
+    };
+
+    const auto index = XmlIndex::Get(doc);
+    for (const auto& branch : branches_) {
+        if (!branch.query) {
+            continue;
+        }
+        if (branch.keys.empty()) {
+            add(Evaluate(index.get(), *doc, branch.path, *branch.query, branch.simple_path.get()));
+            continue;
+        }
+
+        if (!branch.value_path.empty()) {
+            std::vector<pugi::xml_node> nodes;
+            for (const auto& key : branch.keys) {
+                if (!index->FindByValue(branch.ancestors.front(), branch.value_path, key, nodes)) {
+                    return {};
                 }
             }
-        }
-        for (pugi::xml_node n : node.children()) {
-            if (n != last_search) {
-                if (auto found = FindAsset(guid, n, speculate_position - 1); found) {
-                    last_search = n;
-                    return found;
+            for (auto node : nodes) {
+                if (IsReachable(node, branch.ancestors, branch.absolute)) {
+                    add(Evaluate(branch.memoize ? index.get() : nullptr, node, branch.path,
+                                 *branch.query, branch.simple_path.get()));
                 }
             }
+            continue;
         }
-    }
-    else {
-        // normal asset finding
-        for (pugi::xml_node n : node.children()) {
-            if (auto found = FindAsset(guid, n, speculate_position - 1); found) {
-                return found;
+
+        const bool swap_guid = guid && &branch == &branches_.front();
+        const auto keys      = swap_guid ? guid : branch.keys.data();
+        const auto key_count = swap_guid ? 1 : branch.keys.size();
+        for (size_t i = 0; i < key_count; i++) {
+            auto node = FindKeyed(*index, branch, keys[i]);
+            complete  = complete && node && index->Count(branch.key_rule, keys[i]) == 1;
+            if (!node) {
+                continue;
+            }
+            if (assetNode && !*assetNode) {
+                *assetNode = node;
             }
+            add(Evaluate(branch.memoize ? index.get() : nullptr, node, branch.path, *branch.query,
+                         branch.simple_path.get()));
         }
     }
 
-    return {};
+    if (sets <= 1) {
+        return first;
+    }
+
+    // same as XPath unions: no duplicates, document order
+    const auto id = [](const pugi::xpath_node& node) {
+        return std::make_pair(reinterpret_cast<uintptr_t>(node.node().internal_object()),
+                              reinterpret_cast<uintptr_t>(node.attribute().internal_object()));
+    };
+    std::sort(merged.begin(), merged.end(), [&id](const auto& a, const auto& b) { return id(a) < id(b); });
+    merged.erase(std::unique(merged.begin(), merged.end()), merged.end());
+
+    pugi::xpath_node_set results(merged.data(), merged.data() + merged.size());
+    results.sort();
+    return results;
 }
 
-std::optional<pugi::xml_node> XmlLookup::FindTemplate(const std::string& temp, pugi::xml_node node) const
+void XmlOperation::ReadContentPlaceholders()
 {
-#ifndef _WIN32
-    auto stricmp = [](auto a, auto b) { return strcasecmp(a, b); };
-#endif
-    //
-    if (stricmp(node.name(), "Template") == 0) {
-        auto template_name = node.child("Name");
-        if (!template_name) {
-            return {};
+    std::vector<size_t> position;
+    const auto visit = [this, &position](pugi::xml_node node, const auto& visit) -> void {
+        // replacing a placeholder drops everything inside, so don't look there
+        if (node.type() == pugi::node_element && strcmp(node.name(), "ModOpContent") == 0) {
+            content_placeholders_.push_back(position);
+            return;
         }
+        size_t i = 0;
+        for (auto child = node.first_child(); child; child = child.next_sibling(), i++) {
+            position.push_back(i);
+            visit(child, visit);
+            position.pop_back();
+        }
+    };
 
-        if (template_name.text().get() != temp) {
-            return {};
+    size_t i = 0;
+    for (auto node = nodes_->begin(); node != nodes_->end(); node++, i++) {
+        position = {i};
+        visit(*node, visit);
+    }
+}
+
+void XmlOperation::ExpandContent(const pugi::xpath_node_set& results, pugi::xml_node target) const
+{
+    // results fill placeholders in document order, unused ones are taken by the next result
+    std::deque<pugi::xml_node> placeholders;
+    for (const auto& result : results) {
+        pugi::xml_node first;
+        for (auto node = nodes_->begin(); node != nodes_->end(); node++) {
+            auto copy = target.append_copy(*node);
+            first     = first ? first : copy;
         }
 
-        if (speculative_path_type_ == SpeculativePathType::TEMPLATE_CONTAINER) {
-            auto parent = node.parent();
-            while (parent && stricmp(parent.name(), "Templates") != 0) {
-                parent = parent.parent();
-            }
-            if (stricmp(parent.name(), "Templates") == 0) {
-                return parent;
+        for (const auto& position : content_placeholders_) {
+            auto placeholder = first;
+            for (size_t i = 0; i < position.size(); i++) {
+                if (i > 0) {
+                    placeholder = placeholder.first_child();
+                }
+                for (size_t j = 0; j < position[i]; j++) {
+                    placeholder = placeholder.next_sibling();
+                }
             }
-            return {};
-        } else {
-            return node;
+            placeholders.push_back(placeholder);
         }
-    }
 
-    for (pugi::xml_node n : node.children()) {
-        if (auto found = FindTemplate(temp, n); found) {
-            return found;
+        if (placeholders.empty()) {
+            doc_->Warn("ModOps with 'Content' attribute must be empty or contain '<ModOpContent />'", node_);
+            break;
         }
+        auto placeholder = placeholders.front();
+        placeholders.pop_front();
+        placeholder.parent().insert_copy_after(result.node(), placeholder);
+        placeholder.parent().remove_child(placeholder);
     }
+}
 
-    return {};
+void XmlOperation::Apply(std::shared_ptr<pugi::xml_document> doc, const std::set<std::string>& mod_ids)
+{
+    if (guids_.size() <= 1) {
+        return Apply(doc, mod_ids, nullptr);
+    }
+
+    // same as separate ops per GUID, but parsed and compiled only once
+    for (const auto& guid : guids_) {
+        Apply(doc, mod_ids, &guid);
+    }
 }
 
-std::optional<pugi::xml_node> XmlLookup::FindTemplate(std::shared_ptr<pugi::xml_document> doc,
-                                                      const std::string& temp) const
+static std::atomic<size_t> lookup_threads   = 0;
+static std::atomic<size_t> parallel_lookups = 0;
+
+void XmlOperation::SetLookupThreads(size_t threads)
 {
-    return FindTemplate(temp, doc->root());
+    lookup_threads = threads;
 }
 
-pugi::xpath_node_set XmlLookup::ReadGuidNodes(std::shared_ptr<pugi::xml_document> doc, std::optional<pugi::xml_node>* assetNode) const
+size_t XmlOperation::GetParallelLookups()
 {
-    pugi::xpath_node_set results;
-    std::optional<pugi::xml_node> node;
+    return parallel_lookups;
+}
 
-    if (!guid_.empty()) {
+void XmlOperation::ApplyAll(std::vector<XmlOperation>& operations, std::shared_ptr<pugi::xml_document> doc,
+                            const std::set<std::string>& mod_ids)
+{
+    XmlMemory::Scope memory{XmlMemory::Stage::Apply};
+    ApplyAll(operations.data(), operations.data() + operations.size(), doc, mod_ids);
+}
+
+void XmlOperation::ApplyAll(XmlOperation* begin, XmlOperation* end, std::shared_ptr<pugi::xml_document> doc,
+                            const std::set<std::string>& mod_ids)
+{
+    struct Step {
+        XmlOperation*                       operation;
+        const std::string*                  guid;
+        pugi::xml_node                      scope;
+        std::optional<pugi::xpath_node_set> results;
+    };
+    std::vector<Step>               batch;
+    std::unordered_set<const void*> scopes;
+    std::unordered_set<const void*> scope_ancestors;
+    std::shared_ptr<XmlIndex>       index;
+
+    const auto resolve = [&batch](size_t i) {
         try {
-            auto cached = (assetNode && *assetNode) ? FindAsset(guid_, **assetNode) : std::optional<pugi::xml_node>{};
-            node = cached ? cached : FindAsset(guid_, doc->root());
-            if (node) {
-                if (speculative_path_ != "*") {
-                    results = node->select_nodes(speculative_path_.c_str());
+            auto results = batch[i].operation->path_.SelectInScope(batch[i].scope);
+            if (!results.empty()) {
+                batch[i].results = std::move(results);
+            }
+        } catch (...) {
+            // looked up again when applying
+        }
+    };
+
+    const auto flush = [&]() {
+        // pugixml allocates nodes per document, so only lookups can run concurrently.
+        // Most lookups take microseconds, workers only take over when the first ones show the rest is worth it.
+        size_t threads = lookup_threads;
+        size_t done    = 0;
+        if (threads == 0) {
+            const auto start = std::chrono::steady_clock::now();
+            while (done < batch.size()) {
+                resolve(done++);
+                if (done < PARALLEL_LOOKUPS) {
+                    continue;
+                }
+                const auto rest = (std::chrono::steady_clock::now() - start) * (batch.size() - done) / done;
+                threads = std::min<size_t>(std::thread::hardware_concurrency(), rest / PARALLEL_LOOKUP_TIME);
+                if (threads > 1) {
+                    break;
                 }
             }
-        } catch (const pugi::xpath_exception& e) {
-            context_->Error("Speculative path failed to find node with path \"" + GetPath() +
-                       "\" " + speculative_path_, node_);
-            context_->Error(e.what());
         }
-    }
+        if (threads > 1 && done < batch.size()) {
+            XmlThreadPool::Get().Run(batch.size() - done, threads, [&resolve, done](size_t i) { resolve(done + i); });
+            parallel_lookups += batch.size() - done;
+        }
 
-    if (assetNode) {
-        *assetNode = node;
+        // Changes stay inside of their scope, but a key may have been moved to another element.
+        // Anything looked up normally may have changed any scope, so look up everything after it again.
+        bool resolved = true;
+        for (auto& step : batch) {
+            resolved = resolved && step.results && step.operation->path_.FindScope(*index, step.guid) == step.scope;
+            step.operation->Apply(doc, mod_ids, step.guid, resolved ? &*step.results : nullptr);
+        }
+        batch.clear();
+        scopes.clear();
+        scope_ancestors.clear();
+    };
+
+    // scopes of a batch must not overlap, i.e. none may contain another
+    const auto add = [&](XmlOperation& operation, const std::string* guid) {
+        operation.Materialize(doc, guid);
+        auto scope = operation.path_.FindScope(*index, guid);
+        if (!scope) {
+            flush();
+            operation.Apply(doc, mod_ids, guid);
+            return;
+        }
+
+        bool overlaps = scope_ancestors.count(scope.internal_object()) > 0;
+        for (auto node = scope; node && !overlaps; node = node.parent()) {
+            overlaps = scopes.count(node.internal_object()) > 0;
+        }
+        if (overlaps) {
+            flush();
+        }
+
+        scopes.insert(scope.internal_object());
+        for (auto node = scope.parent(); node; node = node.parent()) {
+            scope_ancestors.insert(node.internal_object());
+        }
+        batch.push_back({&operation, guid, scope, {}});
+    };
+
+    for (auto it = begin; it != end; it += 1 + it->group_size_) {
+        auto& operation = *it;
+        // anything which may look outside of its target is a barrier
+        const bool scoped = operation.type_ != Type::None && operation.type_ != Type::Group &&
+                            operation.content_.IsEmpty() &&
+                            (operation.condition_.IsEmpty() || operation.condition_.IsModId());
+        if (!scoped) {
+            flush();
+            operation.Apply(doc, mod_ids);
+            continue;
+        }
+
+        if (!index) {
+            index = XmlIndex::Get(doc);
+        }
+        if (operation.guids_.size() <= 1) {
+            add(operation, nullptr);
+        }
+        else {
+            for (const auto& guid : operation.guids_) {
+                add(operation, &guid);
+            }
+        }
     }
-    return results;
+    flush();
 }
 
-pugi::xpath_node_set XmlLookup::ReadTemplateNodes(std::shared_ptr<pugi::xml_document> doc) const
+void XmlOperation::Materialize(const std::shared_ptr<pugi::xml_document>& doc, const std::string* guid) const
 {
-    pugi::xpath_node_set results;
-    if (!template_.empty()) {
-        try {
-            auto node = FindTemplate(doc, template_);
-            if (node && speculative_path_ != "*") {
-                results = node->select_nodes(speculative_path_.c_str());
-            }
-        } catch (const pugi::xpath_exception& e) {
-            context_->Error("Speculative path failed to find node with path \"" + GetPath() +
-                       "\" " + speculative_path_, node_);
-            context_->Error(e.what());
+    auto lazy = type_ != Type::None ? XmlLazyDocument::Get(doc) : nullptr;
+    if (!lazy) {
+        return;
+    }
+
+    // Conditions only check for results and adds only write into them, so paths not reaching
+    // into assets don't need them. Anything else may read what it selects.
+    const bool adds = type_ == Type::Add || type_ == Type::AddNextSibling || type_ == Type::AddPrevSibling;
+    XmlAccessSet reads;
+    for (const auto lookup : {&condition_, &content_, &path_}) {
+        XmlAccessSet lookup_reads;
+        lookup->GetReads(guid, true, lookup_reads);
+        if (lookup_reads.all && (lookup == &condition_ || (lookup == &path_ && adds)) &&
+            XmlLazyDocument::Avoids(lookup->GetPath(guid))) {
+            continue;
         }
+        reads.Merge(lookup_reads);
     }
-    return results;
+    lazy->Materialize(reads);
 }
 
-void XmlOperation::Apply(std::shared_ptr<pugi::xml_document> doc, const std::set<std::string>& mod_ids)
+void XmlOperation::Apply(std::shared_ptr<pugi::xml_document> doc, const std::set<std::string>& mod_ids,
+                         const std::string* guid, const pugi::xpath_node_set* resolved)
 {
     auto start = std::chrono::high_resolution_clock::now();
     auto logTime = [&start, this](const char* group = "ModOp") {
+        // line numbers are expensive the first time, don't look them up for nothing
+        if (!spdlog::should_log(spdlog::level::debug)) {
+            return;
+        }
         auto end = std::chrono::high_resolution_clock::now();
         auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
         this->doc_->Debug("Time: {}ms {} ({}:{})", duration, group,
             this->doc_->GetGenericPath(), this->doc_->GetLine(node_));
     };
 
+    Materialize(doc, guid);
+
+    XmlAccessLog::Entry* access = nullptr;
+    if (type_ != Type::None) {
+        if (auto access_log = XmlAccessLog::Get(doc)) {
+            access = &access_log->Add(doc_->GetGenericPath(), doc_->GetLine(node_), guid ? *guid : std::string{});
+            if (!condition_.IsModId()) {
+                condition_.GetReads(guid, true, access->reads);
+            }
+        }
+    }
+
     std::optional<pugi::xml_node> cachedNode;
-    if (GetType() == XmlOperation::Type::None || !CheckCondition(doc, cachedNode, mod_ids)) {
+    if (GetType() == XmlOperation::Type::None || !CheckCondition(doc, cachedNode, mod_ids, guid)) {
         return logTime(type_ == Type::Group ? "Group" : "ModOp");
     }
 
     if (type_ == Type::Group) {
         // logTime();
-        for (auto& modop : group_) {
-            modop.Apply(doc, mod_ids);
+        if (include_) {
+            ApplyAll(ReadInclude(), doc, mod_ids);
+        }
+        else {
+            // ops of a group follow it in the same list
+            ApplyAll(this + 1, this + 1 + group_size_, doc, mod_ids);
         }
         logTime("Group");
         return;
     }
 
-    std::optional<pugi::xml_node> wrapper;
+    // expanded content is built outside of the game document
+    pugi::xml_document fragments;
 
     std::vector<pugi::xml_node> content_nodes;
     if (type_ != Type::Remove && !content_.IsEmpty()) {
-        pugi::xpath_node_set result = content_.Select(doc);
+        pugi::xpath_node_set result = content_.Select(doc, nullptr, guid);
+        if (access) {
+            content_.GetReads(guid, !result.empty(), access->reads);
+        }
         if (result.empty()) {
-            doc_->Warn("No matching node for path \"" + content_.GetPath() + "\"", node_);
+            doc_->Warn("No matching node for path \"" + content_.GetPath(guid) + "\"", node_);
             return logTime();
         }
         if (!nodes_ || nodes_->begin() != nodes_->end()) {
-            wrapper = doc->append_child("ModOpTemp");
-            for (auto& node : result) {
-                for (auto wrapper_node = nodes_->begin(); wrapper_node != nodes_->end(); wrapper_node++) {
-
-                    wrapper->append_copy(*wrapper_node);
-                }
-                auto inserter = wrapper->select_node(".//ModOpContent");
-                if (!inserter) {
-                    doc_->Warn("ModOps with 'Content' attribute must be empty or contain '<ModOpContent />'", node_);
-                    break;
-                }
-                else {
-                    inserter.parent().insert_copy_after(node.node(), inserter.node());
-                    inserter.parent().remove_child(inserter.node());
-                }
-            }
-            content_nodes.insert(content_nodes.end(), wrapper->children().begin(), wrapper->children().end());
+            ExpandContent(result, fragments);
+            content_nodes.insert(content_nodes.end(), fragments.children().begin(), fragments.children().end());
         }
         else {
             for (auto& node : result) {
@@ -629,73 +1269,140 @@ void XmlOperation::Apply(std::shared_ptr<pugi::xml_document> doc, const std::set
     }
 
     try {
-        doc_->Debug("Looking up {}", path_.GetPath());
-        auto results = path_.Select(doc, &cachedNode);
+        doc_->Debug("Looking up {}", path_.GetPath(guid));
+        auto results = resolved ? *resolved : path_.Select(doc, &cachedNode, guid);
+        if (access) {
+            path_.GetReads(guid, !results.empty(), access->reads);
+        }
         if (results.empty()) {
             if (allow_no_match_) {
-                doc_->Debug("No matching node for Path \"{}\"", path_.GetPath());
+                doc_->Debug("No matching node for Path \"{}\"", path_.GetPath(guid));
             }
             else {
-                doc_->Warn("No matching node for Path \"" + path_.GetPath() + "\"", node_);
-            }
-            if (wrapper) {
-                doc->remove_child(*wrapper);
+                doc_->Warn("No matching node for Path \"" + path_.GetPath(guid) + "\"", node_);
             }
             return logTime();
         }
 
+        // only maintain an index if there is one already, or if writes are logged by key
+        auto index = XmlIndex::Get(doc, access != nullptr);
+        auto journal = XmlJournal::Get(doc);
+        auto access_log = access ? XmlAccessLog::Get(doc) : nullptr;
         for (pugi::xpath_node xnode : results) {
             pugi::xml_node game_node = xnode.node();
             if (GetType() == XmlOperation::Type::Merge) {
-                if (!content_nodes.empty() && content_nodes.size() == 1 &&
-                    strcmp(content_nodes.begin()->name(), game_node.name()) == 0) {
+                if (content_nodes.empty()) {
+                    continue;
+                }
+                if (content_nodes.size() == 1 && strcmp(content_nodes.begin()->name(), game_node.name()) == 0) {
                     // legacy merge
                     // skip single container if it's named same as the target node
-                    RecursiveMerge(game_node.parent(), *content_nodes.begin());
+                    game_node = game_node.parent();
+                }
+                // keys may change, so they are written before and after
+                if (access_log) {
+                    access_log->Wrote(*access, game_node);
                 }
-                else if (!content_nodes.empty()) {
-                    RecursiveMerge(game_node, *content_nodes.begin());
+                RecursiveMerge(game_node, *content_nodes.begin(), index.get(), journal.get());
+                if (access_log) {
+                    access_log->Wrote(*access, game_node);
                 }
             } else if (GetType() == XmlOperation::Type::AddNextSibling) {
                 for (auto &&node : content_nodes) {
                     game_node = game_node.parent().insert_copy_after(node, game_node);
+                    if (index) {
+                        index->Insert(game_node);
+                    }
+                    if (journal) {
+                        journal->Inserted(game_node);
+                    }
+                    if (access_log) {
+                        access_log->Wrote(*access, game_node);
+                    }
                 }
             } else if (GetType() == XmlOperation::Type::AddPrevSibling) {
                 for (auto &&node : content_nodes) {
-                    game_node.parent().insert_copy_before(node, game_node);
+                    auto added = game_node.parent().insert_copy_before(node, game_node);
+                    if (index) {
+                        index->Insert(added);
+                    }
+                    if (journal) {
+                        journal->Inserted(added);
+                    }
+                    if (access_log) {
+                        access_log->Wrote(*access, added);
+                    }
                 }
             } else if (GetType() == XmlOperation::Type::Add) {
                 for (auto &node : content_nodes) {
-                    game_node.append_copy(node);
+                    auto added = game_node.append_copy(node);
+                    if (index) {
+                        index->Insert(added);
+                    }
+                    if (journal) {
+                        journal->Inserted(added);
+                    }
+                    if (access_log) {
+                        access_log->Wrote(*access, added);
+                    }
                 }
             } else if (GetType() == XmlOperation::Type::Remove) {
-                game_node.parent().remove_child(game_node);
+                auto parent = game_node.parent();
+                if (access_log) {
+                    access_log->Wrote(*access, game_node);
+                }
+                if (index) {
+                    index->Remove(game_node);
+                }
+                if (journal) {
+                    journal->Removing(game_node);
+                }
+                parent.remove_child(game_node);
+                if (index) {
+                    index->Update(parent);
+                }
             } else if (GetType() == XmlOperation::Type::Replace) {
+                auto parent = game_node.parent();
                 for (auto &node : content_nodes) {
-                    game_node.parent().insert_copy_after(node, game_node);
+                    auto added = parent.insert_copy_after(node, game_node);
+                    if (index) {
+                        index->Insert(added);
+                    }
+                    if (journal) {
+                        journal->Inserted(added);
+                    }
+                    if (access_log) {
+                        access_log->Wrote(*access, added);
+                    }
+                }
+                if (access_log) {
+                    access_log->Wrote(*access, game_node);
+                }
+                if (index) {
+                    index->Remove(game_node);
+                }
+                if (journal) {
+                    journal->Removing(game_node);
+                }
+                parent.remove_child(game_node);
+                if (index) {
+                    index->Update(parent);
                 }
-                game_node.parent().remove_child(game_node);
             }
         }
     } catch (const pugi::xpath_exception &e) {
-        doc_->Error("Failed to parse path \"" + path_.GetPath() + "\": " + e.what());
+        doc_->Error("Failed to parse path \"" + path_.GetPath(guid) + "\": " + e.what());
     }
 
-    if (wrapper) {
-        doc->remove_child(*wrapper);
-    }
     logTime();
 }
 
 std::vector<XmlOperation> XmlOperation::GetXmlOperations(
     std::shared_ptr<XmlOperationContext> doc,
     const fs::path& game_path,
-    std::optional<pugi::xml_object_range<pugi::xml_node_iterator>> nodes)
+    std::optional<pugi::xml_object_range<pugi::xml_node_iterator>> nodes,
+    const std::set<std::string>* mod_ids)
 {
-#ifndef _WIN32
-    auto stricmp = [](auto a, auto b) { return strcasecmp(a, b); };
-#endif
-
     if (!doc) {
         return {};
     }
@@ -709,11 +1416,48 @@ std::vector<XmlOperation> XmlOperation::GetXmlOperations(
     }
 
     std::vector<XmlOperation> mod_operations;
-    for (pugi::xml_node node : *nodes) {
+    ReadOperations(mod_operations, doc, game_path, *nodes, mod_ids);
+    return mod_operations;
+}
+
+// `#ModId` conditions don't depend on the game document and can be decided before anything is read.
+static bool IsExcluded(pugi::xml_node node, const std::set<std::string>* mod_ids)
+{
+    std::string_view condition = node.attribute("Condition").as_string();
+    const bool negative = !condition.empty() && condition[0] == '!';
+    if (negative) {
+        condition.remove_prefix(1);
+    }
+    if (!mod_ids || condition.empty() || condition[0] != '#') {
+        return false;
+    }
+
+    condition.remove_prefix(1);
+    return (mod_ids->count(std::string{condition}) > 0) == negative;
+}
+
+void XmlOperation::ReadOperations(std::vector<XmlOperation>& mod_operations,
+                                  std::shared_ptr<XmlOperationContext> doc,
+                                  const fs::path& game_path,
+                                  pugi::xml_object_range<pugi::xml_node_iterator> nodes,
+                                  const std::set<std::string>* mod_ids)
+{
+#ifndef _WIN32
+    auto stricmp = [](auto a, auto b) { return strcasecmp(a, b); };
+#endif
+
+    for (pugi::xml_node node : nodes) {
         if (node.type() == pugi::xml_node_type::node_element) {
             if (node.attribute("Skip")) {
                 continue;
             }
+            if (IsExcluded(node, mod_ids)) {
+                if (spdlog::should_log(spdlog::level::debug)) {
+                    doc->Debug("Condition not matching {} in {} ({}:{})", node.attribute("Condition").as_string(),
+                               doc->GetName(), doc->GetGenericPath(), doc->GetLine(node));
+                }
+                continue;
+            }
 
             if (stricmp(node.name(), "ModOp") == 0) {
                 const auto guid = GetXmlPropString(node, "GUID");
@@ -724,8 +1468,18 @@ std::vector<XmlOperation> XmlOperation::GetXmlOperations(
                 }
                 if (!guid.empty()) {
                     std::vector<std::string> guids = StrSplit(guid, ',');
-                    for (auto g : guids) {
-                        mod_operations.emplace_back(doc, node, g.data(), "");
+                    const bool numeric = std::all_of(guids.begin(), guids.end(), [](const std::string& g) {
+                        return g.find_first_not_of("0123456789") == std::string::npos;
+                    });
+                    if (guids.size() > 1 && numeric) {
+                        // parse once, GUIDs are swapped in when looking up
+                        auto& op = mod_operations.emplace_back(doc, node, guids.front(), "");
+                        op.guids_ = std::move(guids);
+                    }
+                    else {
+                        for (auto g : guids) {
+                            mod_operations.emplace_back(doc, node, g.data(), "");
+                        }
                     }
                 }
                 else {
@@ -733,9 +1487,10 @@ std::vector<XmlOperation> XmlOperation::GetXmlOperations(
                 }
             }
             else if (stricmp(node.name(), "Group") == 0) {
-                auto group_op = XmlOperation{doc, node};
-                group_op.group_ = GetXmlOperations(doc, game_path, node.children());
-                mod_operations.push_back(group_op);
+                const auto group = mod_operations.size();
+                mod_operations.emplace_back(doc, node);
+                ReadOperations(mod_operations, doc, game_path, node.children(), mod_ids);
+                mod_operations[group].group_size_ = mod_operations.size() - group - 1;
             }
             else if (stricmp(node.name(), "Include") == 0) {
                 const auto file = GetXmlPropString(node, "File");
@@ -746,43 +1501,191 @@ std::vector<XmlOperation> XmlOperation::GetXmlOperations(
                     relative_include_path = (doc->GetPath().parent_path() / file).lexically_normal();
                 }
 
-                auto group_op = XmlOperation{doc, node};
-                const auto include_context = doc->OpenInclude(relative_include_path);
-                if (include_context->GetGenericPath().empty()) {
-                    doc->Error("Include file missing or empty: " + relative_include_path.string(), node);
-                }
-                else {
-                    group_op.group_ = GetXmlOperations(include_context, game_path);
-                    mod_operations.push_back(group_op);
-                }
+                // read when applied, its condition may not match anyway
+                auto& include = mod_operations.emplace_back(doc, node);
+                include.include_ = std::make_unique<Include>(Include{relative_include_path, game_path, {}});
             }
         }
     }
+}
 
-    return mod_operations;
+std::vector<XmlOperation>& XmlOperation::ReadInclude()
+{
+    if (include_->operations) {
+        return *include_->operations;
+    }
+
+    auto& operations = include_->operations.emplace();
+    const auto include_context = doc_->OpenInclude(include_->path);
+    if (include_context->GetGenericPath().empty()) {
+        doc_->Error("Include file missing or empty: " + include_->path.string(), node_);
+    }
+    else if (auto root = include_context->GetRoot()) {
+        // shared by applies with any mod IDs, conditions of the ops are checked when applying
+        ReadOperations(operations, include_context, include_->game_path, root.children(), nullptr);
+    }
+    return operations;
 }
 
 std::vector<XmlOperation> XmlOperation::GetXmlOperationsFromFile(const fs::path&    file_path,
                                                                  std::string        mod_name,
                                                                  const fs::path&    game_path,
-                                                                 const fs::path&    mod_path)
+                                                                 const fs::path&    mod_path,
+                                                                 const std::set<std::string>* mod_ids)
 {
     const auto mod_relative_path = file_path.lexically_relative(mod_path);
-    return GetXmlOperations(std::make_shared<XmlOperationContext>(mod_relative_path, mod_path, mod_name), game_path);
+    return GetXmlOperations(std::make_shared<XmlOperationContext>(mod_relative_path, mod_path, mod_name),
+                            game_path, {}, mod_ids);
+}
+
+void XmlOperation::ApplyFile(std::shared_ptr<pugi::xml_document> doc,
+                             const fs::path&    file_path,
+                             std::string        mod_name,
+                             const fs::path&    game_path,
+                             const fs::path&    mod_path,
+                             const std::set<std::string>& mod_ids)
+{
+    auto operations = GetXmlOperationsFromFile(file_path, std::move(mod_name), game_path, mod_path, &mod_ids);
+    ApplyAll(operations, doc, mod_ids);
 }
 
 void MergeProperties(pugi::xml_node game_node, pugi::xml_node patching_node)
 {
     for (pugi::xml_attribute &attr : patching_node.attributes()) {
-        if (auto at = game_node.find_attribute(
-                [attr](auto x) { return std::string(x.name()) == attr.name(); });
-            at) {
+        // merged attributes move to the end
+        if (auto at = game_node.attribute(attr.name())) {
             game_node.remove_attribute(at);
         }
         game_node.append_attribute(attr.name()).set_value(attr.value());
     }
 }
 
+namespace {
+
+// Buffer on the stack for small counts.
+template<typename T, size_t N>
+class SmallBuffer
+{
+public:
+    explicit SmallBuffer(size_t size)
+    {
+        if (size > N) {
+            heap_.resize(size);
+        }
+        data_ = size > N ? heap_.data() : inline_.data();
+    }
+    // data_ may point into inline_ of this object
+    SmallBuffer(const SmallBuffer&)            = delete;
+    SmallBuffer(SmallBuffer&&)                 = delete;
+    SmallBuffer& operator=(const SmallBuffer&) = delete;
+    SmallBuffer& operator=(SmallBuffer&&)      = delete;
+
+    T& operator[](size_t i) { return data_[i]; }
+    const T& operator[](size_t i) const { return data_[i]; }
+
+private:
+    std::array<T, N> inline_{};
+    std::vector<T>   heap_;
+    T*               data_;
+};
+
+// Children of a node bucketed by name in document order, to find the k-th child with a name in O(1).
+// Text and comments share the empty name, same as a search by name() would.
+class ChildBuckets
+{
+public:
+    explicit ChildBuckets(pugi::xml_node parent) :
+        count_(CountChildren(parent)),
+        mask_(TableSize(count_) - 1),
+        slots_(mask_ + 1),
+        nodes_(count_)
+    {
+        SmallBuffer<size_t, INLINE> child_slots(count_);
+        size_t i = 0;
+        for (auto child = parent.first_child(); child; child = child.next_sibling(), i++) {
+            auto& slot = slots_[Lookup(child.name())];
+            slot.name  = child.name();
+            slot.count++;
+            child_slots[i] = &slot - &slots_[0];
+        }
+
+        size_t begin = 0;
+        for (size_t s = 0; s <= mask_; s++) {
+            slots_[s].begin = begin;
+            begin += slots_[s].count;
+        }
+
+        i = 0;
+        for (auto child = parent.first_child(); child; child = child.next_sibling(), i++) {
+            auto& slot = slots_[child_slots[i]];
+            nodes_[slot.begin + slot.used++] = child;
+        }
+        for (size_t s = 0; s <= mask_; s++) {
+            slots_[s].used = 0;
+        }
+    }
+
+    /// @brief Next child named like patch, i.e. the k-th one for the k-th patch node with that name.
+    pugi::xml_node Next(const char* name)
+    {
+        auto& slot = slots_[Lookup(name)];
+        if (!slot.name || slot.used >= slot.count) {
+            return {};
+        }
+        return nodes_[slot.begin + slot.used++];
+    }
+
+private:
+    static constexpr size_t INLINE = 16;
+
+    struct Slot {
+        const char* name  = nullptr;
+        size_t      begin = 0;
+        size_t      count = 0;
+        size_t      used  = 0;
+    };
+
+    size_t                                 count_;
+    size_t                                 mask_;
+    SmallBuffer<Slot, INLINE * 2>          slots_;
+    SmallBuffer<pugi::xml_node, INLINE>    nodes_;
+
+    static size_t CountChildren(pugi::xml_node parent)
+    {
+        size_t count = 0;
+        for (auto child = parent.first_child(); child; child = child.next_sibling()) {
+            count++;
+        }
+        return count;
+    }
+
+    // power of two with at most half of the slots in use
+    static size_t TableSize(size_t count)
+    {
+        size_t size = INLINE * 2;
+        while (size < count * 2) {
+            size *= 2;
+        }
+        return size;
+    }
+
+    // slot of name, or the empty slot where it would be
+    size_t Lookup(const char* name) const
+    {
+        size_t hash = 14695981039346656037ull;
+        for (auto c = name; *c; c++) {
+            hash = (hash ^ static_cast<unsigned char>(*c)) * 1099511628211ull;
+        }
+        for (size_t s = hash & mask_;; s = (s + 1) & mask_) {
+            if (!slots_[s].name || strcmp(slots_[s].name, name) == 0) {
+                return s;
+            }
+        }
+    }
+};
+
+}
+
 static bool HasNonTextNode(pugi::xml_node node)
 {
     while (node) {
@@ -794,28 +1697,13 @@ static bool HasNonTextNode(pugi::xml_node node)
     return false;
 }
 
-void XmlOperation::RecursiveMerge(pugi::xml_node game_node, pugi::xml_node patching_node)
+void XmlOperation::RecursiveMerge(pugi::xml_node game_node, pugi::xml_node patching_node, XmlIndex* index,
+                                  XmlJournal* journal)
 {
     if (!patching_node) {
         return;
     }
 
-    const auto find_node_with_name = [](pugi::xml_node game_node, auto name, int index) -> pugi::xml_node {
-        int found = 0;
-        auto children = game_node.children();
-        for (pugi::xml_node cur_node : children) {
-            if (strcmp(cur_node.name(), name) == 0) {
-                if (found == index) {
-                    return cur_node;
-                }
-                else {
-                    found++;
-                }
-            }
-        }
-        return {};
-    };
-
     if (HasNonTextNode(patching_node)) {
         while (patching_node && patching_node.type() == pugi::xml_node_type::node_pcdata) {
             patching_node = patching_node.next_sibling();
@@ -828,30 +1716,46 @@ void XmlOperation::RecursiveMerge(pugi::xml_node game_node, pugi::xml_node patch
         }
     }
 
+    // the k-th patch node with a name merges into the k-th game node with that name.
+    // nodes appended here would never be matched by later patch nodes, so the buckets stay as they are.
     auto root_node = game_node;
-    std::map<std::string, int> indexer;
+    ChildBuckets game_children{root_node};
     for (auto cur_node = patching_node; cur_node; cur_node = cur_node.next_sibling()) {
-        const auto name = cur_node.name();
-        indexer.try_emplace(name, 0);
-        const int index = indexer[name]++;
-
-        game_node = find_node_with_name(root_node, cur_node.name(), index);
+        game_node = game_children.Next(cur_node.name());
         if (game_node) {
             if (cur_node.type() == pugi::xml_node_type::node_pcdata) {
+                if (journal) {
+                    journal->Changing(game_node);
+                }
                 game_node.set_value(cur_node.value());
+                if (index) {
+                    index->Update(game_node);
+                }
             } else {
+                if (journal && cur_node.first_attribute()) {
+                    journal->Changing(game_node);
+                }
                 MergeProperties(game_node, cur_node);
-                RecursiveMerge(game_node, cur_node.first_child());
+                if (index && cur_node.first_attribute()) {
+                    index->Update(game_node);
+                }
+                RecursiveMerge(game_node, cur_node.first_child(), index, journal);
             }
         }
         else {
-            root_node.append_copy(cur_node);
+            auto added = root_node.append_copy(cur_node);
+            if (index) {
+                index->Insert(added);
+            }
+            if (journal) {
+                journal->Inserted(added);
+            }
         }
     }
 }
 
 bool XmlOperation::CheckCondition(std::shared_ptr<pugi::xml_document> doc, std::optional<pugi::xml_node>& cachedNode,
-    const std::set<std::string>& mod_ids)
+    const std::set<std::string>& mod_ids, const std::string* guid)
 {
     if (condition_.IsEmpty()) {
         return true;
@@ -862,12 +1766,14 @@ bool XmlOperation::CheckCondition(std::shared_ptr<pugi::xml_document> doc, std::
         matching = mod_ids.end() != mod_ids.find(condition_.GetPath());
     }
     else {
-        matching = !condition_.Select(doc, &cachedNode, true).empty();
+        matching = !condition_.Select(doc, &cachedNode, guid).empty();
     }
 
     if (condition_.IsNegative() == matching) {
-        doc_->Debug("Condition not matching {} in {} ({}:{})", condition_.GetPath(), doc_->GetName(),
-                   doc_->GetGenericPath(), doc_->GetLine(node_));
+        if (spdlog::should_log(spdlog::level::debug)) {
+            doc_->Debug("Condition not matching {} in {} ({}:{})", condition_.GetPath(guid), doc_->GetName(),
+                        doc_->GetGenericPath(), doc_->GetLine(node_));
+        }
         return false;
     }
 
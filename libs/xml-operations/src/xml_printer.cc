@@ -0,0 +1,182 @@
+#include "xml_printer.h"
+#include "xml_thread_pool.h"
+
+#include <algorithm>
+#include <limits>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace xmlops {
+
+static constexpr const char* RUN_MARKER = "xmlops-print-run";
+
+struct PrintWriter : pugi::xml_writer {
+    std::string output;
+
+    void write(const void* data, size_t size) override
+    {
+        output.append(static_cast<const char*>(data), size);
+    }
+};
+
+struct PrintRun {
+    pugi::xml_node first;
+    size_t         count;
+    unsigned int   depth;
+    pugi::xml_node marker;
+    std::string    output;
+};
+
+/// @returns nodes in the subtree of node. Those of subtrees larger than target are added to sizes.
+static size_t CountNodes(pugi::xml_node node, size_t target,
+                         std::unordered_map<pugi::xml_node_struct*, size_t>* sizes)
+{
+    size_t count = 1;
+    for (auto child = node.first_child(); child; child = child.next_sibling()) {
+        count += CountNodes(child, target, sizes);
+    }
+    if (sizes && count > target) {
+        (*sizes)[node.internal_object()] = count;
+    }
+    return count;
+}
+
+/// @returns whether the subtree of node has more than limit nodes below it, visiting at most that many.
+static bool HasMoreNodes(pugi::xml_node node, size_t& limit)
+{
+    for (auto child = node.first_child(); child; child = child.next_sibling()) {
+        if (limit == 0) {
+            return true;
+        }
+        limit--;
+        if (HasMoreNodes(child, limit)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/// @brief pugixml indents children depending on text between them, runs can't start in such nodes.
+static bool HasText(pugi::xml_node node)
+{
+    if (*node.value()) {
+        return true;
+    }
+    for (auto child = node.first_child(); child; child = child.next_sibling()) {
+        if (child.type() == pugi::node_pcdata || child.type() == pugi::node_cdata) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/// @brief Group the children of node into runs, or plan large children without text the same way.
+///        copy gets a marker element for each run and a copy without children of each planned child.
+/// @param depth Depth of the children of node.
+static void PlanRuns(pugi::xml_node node, size_t nodes, unsigned int depth, pugi::xml_node copy, size_t target,
+                     const std::unordered_map<pugi::xml_node_struct*, size_t>& sizes, std::vector<PrintRun>& runs)
+{
+    // only large children have their size counted, the others share the rest evenly
+    size_t small_children = 0;
+    size_t small_nodes    = nodes - 1;
+    for (auto child = node.first_child(); child; child = child.next_sibling()) {
+        if (auto it = sizes.find(child.internal_object()); it != sizes.end()) {
+            small_nodes -= it->second;
+        }
+        else {
+            small_children++;
+        }
+    }
+    const size_t small_size = small_children ? std::max<size_t>(1, small_nodes / small_children) : 0;
+
+    bool   open      = false;
+    size_t run_nodes = 0;
+    for (auto child = node.first_child(); child; child = child.next_sibling()) {
+        const auto it = sizes.find(child.internal_object());
+        if (it != sizes.end() && child.type() == pugi::node_element && !HasText(child)) {
+            auto planned = copy.append_child(pugi::node_element);
+            planned.set_name(child.name());
+            for (auto attribute : child.attributes()) {
+                planned.append_copy(attribute);
+            }
+            PlanRuns(child, it->second, depth + 1, planned, target, sizes, runs);
+            open = false;
+            continue;
+        }
+
+        const size_t child_nodes = it != sizes.end() ? it->second : small_size;
+        if (!open || run_nodes + child_nodes > target) {
+            runs.push_back({child, 0, depth, copy.append_child(RUN_MARKER), {}});
+            open      = true;
+            run_nodes = 0;
+        }
+        runs.back().count++;
+        run_nodes += child_nodes;
+    }
+}
+
+void XmlPrinter::Print(const pugi::xml_document& doc, pugi::xml_writer& writer, const pugi::char_t* indent,
+                       unsigned int flags, size_t threads)
+{
+    // most documents are too small for threads, those are only counted up to the bound
+    size_t limit = PARALLEL_NODES * 2;
+    if (HasText(doc) || (threads == 0 && !HasMoreNodes(doc, limit))) {
+        doc.print(writer, indent, flags);
+        return;
+    }
+
+    const size_t nodes = CountNodes(doc, std::numeric_limits<size_t>::max(), nullptr);
+    if (threads == 0) {
+        threads = std::min<size_t>(std::thread::hardware_concurrency(), nodes / PARALLEL_NODES);
+    }
+    if (threads <= 1) {
+        doc.print(writer, indent, flags);
+        return;
+    }
+
+    const size_t                                       target = std::max<size_t>(1, nodes / (threads * RUNS_PER_THREAD));
+    std::unordered_map<pugi::xml_node_struct*, size_t> sizes;
+    CountNodes(doc, target, &sizes);
+
+    pugi::xml_document    skeleton;
+    std::vector<PrintRun> runs;
+    PlanRuns(doc, nodes, 0, skeleton, target, sizes, runs);
+
+    XmlThreadPool::Get().Run(runs.size(), threads, [&](size_t i) {
+        PrintWriter run_writer;
+        auto        node = runs[i].first;
+        for (size_t n = 0; n < runs[i].count; n++, node = node.next_sibling()) {
+            node.print(run_writer, indent, flags, pugi::encoding_auto, runs[i].depth);
+        }
+        runs[i].output = std::move(run_writer.output);
+    });
+
+    // a marker is printed the same as its run would be on its own, without text around both
+    PrintWriter frame;
+    skeleton.print(frame, indent, flags);
+    std::vector<std::pair<size_t, size_t>> markers;
+    for (size_t i = 0, offset = 0; i < runs.size(); i++) {
+        PrintWriter marker;
+        runs[i].marker.print(marker, indent, flags, pugi::encoding_auto, runs[i].depth);
+        const auto found = frame.output.find(marker.output, offset);
+        if (found == std::string::npos) {
+            doc.print(writer, indent, flags);
+            return;
+        }
+        offset = found + marker.output.size();
+        markers.emplace_back(found, offset);
+    }
+
+    size_t offset = 0;
+    for (size_t i = 0; i < runs.size(); i++) {
+        writer.write(frame.output.data() + offset, markers[i].first - offset);
+        writer.write(runs[i].output.data(), runs[i].output.size());
+        std::string{}.swap(runs[i].output);
+        offset = markers[i].second;
+    }
+    writer.write(frame.output.data() + offset, frame.output.size() - offset);
+}
+
+}
@@ -0,0 +1,395 @@
+#include "xml_shared_tree.h"
+#include "xml_escape.h"
+
+#include <algorithm>
+#include <functional>
+
+namespace xmlops {
+
+// Estimated size of pugixml node and attribute structs, strings come on top.
+static constexpr size_t NODE_BYTES      = 8 * sizeof(void*);
+static constexpr size_t ATTRIBUTE_BYTES = 5 * sizeof(void*);
+
+static void Combine(size_t& hash, size_t value)
+{
+    hash ^= value + 0x9e3779b97f4a7c15ull + (hash << 6) + (hash >> 2);
+}
+
+static size_t StringBytes(std::string_view text)
+{
+    return text.empty() ? 0 : text.size() + 1;
+}
+
+std::shared_ptr<XmlSharedTree> XmlSharedTree::Build(pugi::xml_node root)
+{
+    auto tree = std::make_shared<XmlSharedTree>();
+    tree->SetRoot(tree->Add(root));
+    return tree;
+}
+
+std::string_view XmlSharedTree::Intern(std::string_view text)
+{
+    auto it = string_ids_.find(text);
+    if (it != string_ids_.end()) {
+        return *it;
+    }
+    // deque elements don't move, views into them stay valid and null-terminated
+    return *string_ids_.emplace(strings_.emplace_back(text)).first;
+}
+
+bool XmlSharedTree::NodeEqual::operator()(const Node* a, const Node* b) const
+{
+    // strings are interned and children are shared, comparing pointers is enough
+    const auto same = [](std::string_view a, std::string_view b) { return a.data() == b.data(); };
+    if (a->type != b->type || !same(a->name, b->name) || !same(a->value, b->value) ||
+        a->attributes.size() != b->attributes.size() || a->children != b->children) {
+        return false;
+    }
+    for (size_t i = 0; i < a->attributes.size(); i++) {
+        if (!same(a->attributes[i].first, b->attributes[i].first) ||
+            !same(a->attributes[i].second, b->attributes[i].second)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+const XmlSharedTree::Node* XmlSharedTree::Intern(Node&& node)
+{
+    const std::hash<const void*> pointer_hash;
+    node.hash       = static_cast<size_t>(node.type);
+    node.tree_nodes = 1;
+    node.tree_bytes = NODE_BYTES + StringBytes(node.name) + StringBytes(node.value);
+    Combine(node.hash, pointer_hash(node.name.data()));
+    Combine(node.hash, pointer_hash(node.value.data()));
+    for (const auto& [name, value] : node.attributes) {
+        Combine(node.hash, pointer_hash(name.data()));
+        Combine(node.hash, pointer_hash(value.data()));
+        node.tree_bytes += ATTRIBUTE_BYTES + StringBytes(name) + StringBytes(value);
+    }
+    for (auto child : node.children) {
+        Combine(node.hash, pointer_hash(child));
+        node.tree_nodes += child->tree_nodes;
+        node.tree_bytes += child->tree_bytes;
+    }
+
+    if (auto it = unique_.find(&node); it != unique_.end()) {
+        return *it;
+    }
+
+    node.uses = 0;
+    Node* stored;
+    if (free_.empty()) {
+        stored = &nodes_.emplace_back(std::move(node));
+    }
+    else {
+        stored  = free_.back();
+        *stored = std::move(node);
+        free_.pop_back();
+    }
+    for (auto child : stored->children) {
+        child->uses++;
+    }
+    unique_.insert(stored);
+    return stored;
+}
+
+void XmlSharedTree::SetRoot(const Node* root)
+{
+    // the new root may be the old one if a change didn't change anything
+    root->uses++;
+    if (root_) {
+        Release(root_);
+    }
+    root_ = root;
+}
+
+void XmlSharedTree::Release(const Node* node)
+{
+    if (--node->uses > 0) {
+        return;
+    }
+
+    unique_.erase(node);
+    for (auto child : node->children) {
+        Release(child);
+    }
+    // slots are elements of nodes_, only handed out as const
+    auto slot = const_cast<Node*>(node);
+    slot->children   = {};
+    slot->attributes = {};
+    free_.push_back(slot);
+}
+
+const XmlSharedTree::Node* XmlSharedTree::Add(pugi::xml_node node)
+{
+    Node shared{};
+    shared.type  = node.type();
+    shared.name  = Intern(node.name());
+    shared.value = Intern(node.value());
+    for (auto attribute : node.attributes()) {
+        shared.attributes.emplace_back(Intern(attribute.name()), Intern(attribute.value()));
+    }
+    for (auto child : node.children()) {
+        shared.children.push_back(Add(child));
+    }
+    return Intern(std::move(shared));
+}
+
+std::vector<size_t> XmlSharedTree::GetPath(pugi::xml_node node)
+{
+    std::vector<size_t> path;
+    for (; node.parent(); node = node.parent()) {
+        size_t index = 0;
+        for (auto sibling = node.previous_sibling(); sibling; sibling = sibling.previous_sibling()) {
+            index++;
+        }
+        path.push_back(index);
+    }
+    std::reverse(path.begin(), path.end());
+    return path;
+}
+
+const XmlSharedTree::Node* XmlSharedTree::Get(const std::vector<size_t>& path) const
+{
+    const Node* node = root_;
+    for (auto index : path) {
+        if (!node || index >= node->children.size()) {
+            return nullptr;
+        }
+        node = node->children[index];
+    }
+    return node;
+}
+
+template <class Change>
+const XmlSharedTree::Node* XmlSharedTree::Rebuild(const Node* node, const std::vector<size_t>& path, size_t depth,
+                                                  Change& change)
+{
+    Node copy = *node;
+    if (depth + 1 == path.size()) {
+        if (!change(copy.children, path.back())) {
+            return nullptr;
+        }
+        return Intern(std::move(copy));
+    }
+
+    if (path[depth] >= node->children.size()) {
+        return nullptr;
+    }
+    auto child = Rebuild(node->children[path[depth]], path, depth + 1, change);
+    if (!child) {
+        return nullptr;
+    }
+    copy.children[path[depth]] = child;
+    return Intern(std::move(copy));
+}
+
+bool XmlSharedTree::Replace(const std::vector<size_t>& path, const Node* node)
+{
+    if (path.empty()) {
+        SetRoot(node);
+        return true;
+    }
+
+    auto change = [node](std::vector<const Node*>& children, size_t index) {
+        if (index >= children.size()) {
+            return false;
+        }
+        children[index] = node;
+        return true;
+    };
+    auto root = Rebuild(root_, path, 0, change);
+    if (root) {
+        SetRoot(root);
+    }
+    return root != nullptr;
+}
+
+bool XmlSharedTree::Insert(const std::vector<size_t>& path, const Node* node)
+{
+    if (path.empty()) {
+        return false;
+    }
+
+    auto change = [node](std::vector<const Node*>& children, size_t index) {
+        if (index > children.size()) {
+            return false;
+        }
+        children.insert(children.begin() + index, node);
+        return true;
+    };
+    auto root = Rebuild(root_, path, 0, change);
+    if (root) {
+        SetRoot(root);
+    }
+    return root != nullptr;
+}
+
+bool XmlSharedTree::Remove(const std::vector<size_t>& path)
+{
+    if (path.empty()) {
+        return false;
+    }
+
+    auto change = [](std::vector<const Node*>& children, size_t index) {
+        if (index >= children.size()) {
+            return false;
+        }
+        children.erase(children.begin() + index);
+        return true;
+    };
+    auto root = Rebuild(root_, path, 0, change);
+    if (root) {
+        SetRoot(root);
+    }
+    return root != nullptr;
+}
+
+void XmlSharedTree::Print(std::ostream& out, const Node* node) const
+{
+    std::string                                                output;
+    std::unordered_map<const Node*, std::pair<size_t, size_t>> printed;
+    Print(node, printed, output);
+    out.write(output.data(), output.size());
+}
+
+void XmlSharedTree::Print(const Node* node, std::unordered_map<const Node*, std::pair<size_t, size_t>>& printed,
+                          std::string& output) const
+{
+    const bool shared = node->uses > 1;
+    if (shared) {
+        if (auto it = printed.find(node); it != printed.end()) {
+            output.append(output, it->second.first, it->second.second);
+            return;
+        }
+    }
+
+    const auto start   = output.size();
+    const auto append  = [&output](std::string_view text) { output.append(text); };
+    const auto print_attributes = [&output, &append, node]() {
+        for (const auto& [name, value] : node->attributes) {
+            output += ' ';
+            output.append(name);
+            output += "=\"";
+            WriteEscaped(value, true, append);
+            output += '"';
+        }
+    };
+
+    switch (node->type) {
+    case pugi::node_document:
+        for (auto child : node->children) {
+            Print(child, printed, output);
+        }
+        break;
+    case pugi::node_element:
+        output += '<';
+        output.append(node->name);
+        print_attributes();
+        if (node->children.empty()) {
+            output += "/>";
+            break;
+        }
+        output += '>';
+        for (auto child : node->children) {
+            Print(child, printed, output);
+        }
+        output += "</";
+        output.append(node->name);
+        output += '>';
+        break;
+    case pugi::node_pcdata:
+        WriteEscaped(node->value, false, append);
+        break;
+    case pugi::node_cdata:
+        output += "<![CDATA[";
+        output.append(node->value);
+        output += "]]>";
+        break;
+    case pugi::node_comment:
+        output += "<!--";
+        output.append(node->value);
+        output += "-->";
+        break;
+    case pugi::node_pi:
+        output += "<?";
+        output.append(node->name);
+        if (!node->value.empty()) {
+            output += ' ';
+            output.append(node->value);
+        }
+        output += "?>";
+        break;
+    case pugi::node_declaration:
+        output += "<?";
+        output.append(node->name);
+        print_attributes();
+        output += "?>";
+        break;
+    case pugi::node_doctype:
+        output += "<!DOCTYPE ";
+        output.append(node->value);
+        output += '>';
+        break;
+    default:
+        break;
+    }
+
+    if (shared) {
+        printed[node] = {start, output.size() - start};
+    }
+}
+
+pugi::xml_node XmlSharedTree::CopyTo(const Node* node, pugi::xml_node parent) const
+{
+    // interned strings are null-terminated
+    auto copy = node->type == pugi::node_document ? parent : parent.append_child(node->type);
+    if (node->type != pugi::node_document) {
+        if (!node->name.empty()) {
+            copy.set_name(node->name.data());
+        }
+        if (!node->value.empty()) {
+            copy.set_value(node->value.data());
+        }
+        for (const auto& [name, value] : node->attributes) {
+            copy.append_attribute(name.data()).set_value(value.data());
+        }
+    }
+
+    for (auto child : node->children) {
+        CopyTo(child, copy);
+    }
+    return copy;
+}
+
+XmlSharedTree::Stats XmlSharedTree::GetStats() const
+{
+    Stats stats;
+    if (!root_) {
+        return stats;
+    }
+    stats.nodes = root_->tree_nodes;
+    stats.bytes = root_->tree_bytes;
+
+    size_t                          unique_bytes = 0;
+    std::unordered_set<const Node*> visited{root_};
+    std::vector<const Node*>        stack{root_};
+    while (!stack.empty()) {
+        const auto node = stack.back();
+        stack.pop_back();
+        unique_bytes += node->tree_bytes;
+        for (auto child : node->children) {
+            unique_bytes -= child->tree_bytes;
+            if (visited.insert(child).second) {
+                stack.push_back(child);
+            }
+        }
+    }
+    stats.unique_nodes = visited.size();
+    stats.stored_nodes = nodes_.size() - free_.size();
+    stats.saved_bytes  = stats.bytes - unique_bytes;
+    return stats;
+}
+
+}
@@ -0,0 +1,265 @@
+#include "xml_simple_path.h"
+
+#include <array>
+#include <cctype>
+#include <cstring>
+
+namespace xmlops {
+
+static bool IsNameStart(char c)
+{
+    return isalpha(static_cast<unsigned char>(c)) || c == '_';
+}
+
+static bool IsNameChar(char c)
+{
+    return isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '-' || c == '.';
+}
+
+static bool ReadName(const std::string& path, size_t& pos, std::string& name)
+{
+    if (pos >= path.size() || !IsNameStart(path[pos])) {
+        return false;
+    }
+    const auto start = pos;
+    while (pos < path.size() && IsNameChar(path[pos])) {
+        pos++;
+    }
+    name = path.substr(start, pos - start);
+    return true;
+}
+
+static void SkipSpaces(const std::string& path, size_t& pos)
+{
+    while (pos < path.size() && path[pos] == ' ') {
+        pos++;
+    }
+}
+
+// Compares the XPath string-value, i.e. all descendant text concatenated, without building it.
+static bool StringValueEquals(pugi::xml_node node, const std::string& value)
+{
+    size_t pos = 0;
+    auto   cur = node.first_child();
+    while (cur) {
+        if (cur.type() == pugi::node_pcdata || cur.type() == pugi::node_cdata) {
+            const auto text   = cur.value();
+            const auto length = strlen(text);
+            if (length > value.size() - pos || value.compare(pos, length, text) != 0) {
+                return false;
+            }
+            pos += length;
+        }
+
+        if (cur.first_child()) {
+            cur = cur.first_child();
+            continue;
+        }
+        while (!cur.next_sibling()) {
+            cur = cur.parent();
+            if (cur == node) {
+                return pos == value.size();
+            }
+        }
+        cur = cur.next_sibling();
+    }
+    return pos == value.size();
+}
+
+static bool HasValue(pugi::xml_node node, const std::vector<std::string>& path, size_t step,
+                     const std::string& value)
+{
+    if (step == path.size()) {
+        return StringValueEquals(node, value);
+    }
+    const auto name = path[step].c_str();
+    for (auto child = node.child(name); child; child = child.next_sibling(name)) {
+        if (HasValue(child, path, step + 1, value)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Results are gathered on the stack unless there are many of them, so the node set is allocated once
+// at its final size. pugixml stores a single node inline, more always take one allocation.
+class XmlSimplePath::Collector
+{
+public:
+    void Add(pugi::xml_node node)
+    {
+        if (overflow_.empty() && size_ < inline_.size()) {
+            inline_[size_++] = node;
+            return;
+        }
+        if (overflow_.empty()) {
+            overflow_.assign(inline_.begin(), inline_.end());
+        }
+        overflow_.emplace_back(node);
+    }
+
+    pugi::xpath_node_set Get() const
+    {
+        if (!overflow_.empty()) {
+            return {overflow_.data(), overflow_.data() + overflow_.size(),
+                    pugi::xpath_node_set::type_sorted};
+        }
+        if (size_ == 0) {
+            return {};
+        }
+        return {inline_.data(), inline_.data() + size_, pugi::xpath_node_set::type_sorted};
+    }
+
+private:
+    std::array<pugi::xpath_node, 32> inline_;
+    size_t                           size_ = 0;
+    std::vector<pugi::xpath_node>    overflow_;
+};
+
+std::shared_ptr<const XmlSimplePath> XmlSimplePath::Parse(const std::string& path)
+{
+    auto result = std::make_shared<XmlSimplePath>();
+    if (path == "self::node()" || path == ".") {
+        return result;
+    }
+
+    size_t pos = 0;
+    if (!path.empty() && path[0] == '/') {
+        result->absolute_ = true;
+        pos++;
+    }
+
+    while (true) {
+        auto& step = result->steps_.emplace_back();
+        if (pos < path.size() && path[pos] == '*') {
+            pos++;
+        }
+        else if (!ReadName(path, pos, step.name)) {
+            return {};
+        }
+        else if (step.name == "text" && path.compare(pos, 2, "()") == 0) {
+            pos += 2;
+            step.name.clear();
+            step.text = true;
+        }
+
+        while (pos < path.size() && path[pos] == '[') {
+            if (step.text || step.predicates.size() >= MAX_PREDICATES) {
+                return {};
+            }
+            pos++;
+
+            auto& predicate = step.predicates.emplace_back();
+            if (pos < path.size() && isdigit(static_cast<unsigned char>(path[pos]))) {
+                const auto start = pos;
+                while (pos < path.size() && isdigit(static_cast<unsigned char>(path[pos]))) {
+                    predicate.position = predicate.position * 10 + (path[pos] - '0');
+                    pos++;
+                }
+                if (predicate.position == 0 || pos - start > 9) {
+                    return {};
+                }
+            }
+            else {
+                while (true) {
+                    if (!ReadName(path, pos, predicate.child_path.emplace_back())) {
+                        return {};
+                    }
+                    if (pos >= path.size() || path[pos] != '/') {
+                        break;
+                    }
+                    pos++;
+                }
+
+                SkipSpaces(path, pos);
+                if (pos >= path.size() || path[pos] != '=') {
+                    return {};
+                }
+                pos++;
+                SkipSpaces(path, pos);
+                if (pos >= path.size() || (path[pos] != '\'' && path[pos] != '"')) {
+                    return {};
+                }
+                const auto value_end = path.find(path[pos], pos + 1);
+                if (value_end == std::string::npos) {
+                    return {};
+                }
+                predicate.value = path.substr(pos + 1, value_end - pos - 1);
+                pos = value_end + 1;
+            }
+
+            if (pos >= path.size() || path[pos] != ']') {
+                return {};
+            }
+            pos++;
+        }
+
+        if (pos == path.size()) {
+            return result;
+        }
+        // text() has to be the last step
+        if (path[pos] != '/' || step.text) {
+            return {};
+        }
+        pos++;
+    }
+}
+
+pugi::xpath_node_set XmlSimplePath::Select(pugi::xml_node context) const
+{
+    if (!context) {
+        return {};
+    }
+
+    Collector results;
+    Select(absolute_ ? context.root() : context, 0, results);
+    return results.Get();
+}
+
+void XmlSimplePath::Select(pugi::xml_node node, size_t step_index, Collector& results) const
+{
+    if (step_index == steps_.size()) {
+        results.Add(node);
+        return;
+    }
+
+    const auto& step = steps_[step_index];
+    if (step.text) {
+        for (auto child = node.first_child(); child; child = child.next_sibling()) {
+            if (child.type() == pugi::node_pcdata || child.type() == pugi::node_cdata) {
+                results.Add(child);
+            }
+        }
+        return;
+    }
+
+    // children are visited in document order, so positions can be counted along the way
+    size_t counters[MAX_PREDICATES] = {};
+    for (auto child = node.first_child(); child; child = child.next_sibling()) {
+        if (child.type() != pugi::node_element ||
+            (!step.name.empty() && strcmp(child.name(), step.name.c_str()) != 0)) {
+            continue;
+        }
+
+        bool matches = true;
+        for (size_t i = 0; matches && i < step.predicates.size(); i++) {
+            const auto& predicate = step.predicates[i];
+            if (predicate.position) {
+                matches = ++counters[i] == predicate.position;
+            }
+            else {
+                matches = HasValue(child, predicate.child_path, 0, predicate.value);
+            }
+        }
+        if (matches) {
+            Select(child, step_index + 1, results);
+        }
+
+        if (!step.predicates.empty() && step.predicates[0].position &&
+            counters[0] >= step.predicates[0].position) {
+            break;
+        }
+    }
+}
+
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "pugixml.hpp"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace xmlops {
+
+/// @brief Evaluates the common subset of XPath without the XPath VM.
+///        Supports child steps by name or `*`, a final `text()`, `[n]` and `[Child/Path='value']`
+///        predicates, as well as `self::node()`.
+class XmlSimplePath
+{
+public:
+    /// @returns nullptr if the path uses anything outside of the supported subset.
+    static std::shared_ptr<const XmlSimplePath> Parse(const std::string& path);
+
+    /// @brief Select nodes in document order, same as pugixml would.
+    ///        More than one result allocates the node set once, lookups memoize and pass on node sets.
+    pugi::xpath_node_set Select(pugi::xml_node context) const;
+
+private:
+    static constexpr size_t MAX_PREDICATES = 4;
+
+    struct Predicate {
+        /// @brief 1-based position for `[n]`, 0 for value comparisons.
+        size_t position = 0;
+        std::vector<std::string> child_path;
+        std::string value;
+    };
+
+    struct Step {
+        /// @brief Element name, empty for `*`.
+        std::string name;
+        bool text = false;
+        std::vector<Predicate> predicates;
+    };
+
+    class Collector;
+
+    bool absolute_ = false;
+    /// @brief Empty for `self::node()`.
+    std::vector<Step> steps_;
+
+    void Select(pugi::xml_node node, size_t step, Collector& results) const;
+};
+
+}
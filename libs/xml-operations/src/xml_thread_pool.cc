@@ -0,0 +1,72 @@
+#include "xml_thread_pool.h"
+
+#include <algorithm>
+#include <thread>
+
+namespace xmlops {
+
+XmlThreadPool& XmlThreadPool::Get()
+{
+    static auto* pool = new XmlThreadPool();
+    return *pool;
+}
+
+void XmlThreadPool::Run(size_t count, size_t threads, const std::function<void(size_t)>& task)
+{
+    std::unique_lock<std::mutex> run{run_mutex_, std::try_to_lock};
+    threads = std::min(threads, count);
+    if (!run || threads <= 1) {
+        for (size_t i = 0; i < count; i++) {
+            task(i);
+        }
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock{mutex_};
+        for (; workers_ < threads - 1; workers_++) {
+            std::thread([this, generation = generation_]() { Work(generation); }).detach();
+        }
+        task_   = &task;
+        count_  = count;
+        next_   = 0;
+        wanted_ = threads - 1;
+        generation_++;
+    }
+    wake_.notify_all();
+
+    Drain();
+
+    // workers which didn't wake up in time have nothing left to do
+    std::unique_lock<std::mutex> lock{mutex_};
+    wanted_ = 0;
+    done_.wait(lock, [this]() { return active_ == 0; });
+}
+
+void XmlThreadPool::Work(uint64_t generation)
+{
+    std::unique_lock<std::mutex> lock{mutex_};
+    for (;;) {
+        wake_.wait(lock, [this, generation]() { return generation_ != generation && wanted_ > 0; });
+        generation = generation_;
+        wanted_--;
+        active_++;
+
+        lock.unlock();
+        Drain();
+        lock.lock();
+
+        if (--active_ == 0) {
+            done_.notify_all();
+        }
+    }
+}
+
+void XmlThreadPool::Drain()
+{
+    for (size_t i; (i = next_++) < count_;) {
+        (*task_)(i);
+    }
+}
+
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+
+namespace xmlops {
+
+/// @brief Worker threads kept for short parallel loops, so they don't pay for starting threads each time.
+///        Workers are started on first use and never stopped.
+class XmlThreadPool
+{
+public:
+    /// @brief The pool shared by all callers. Never destroyed, workers can't be joined while the DLL unloads.
+    static XmlThreadPool& Get();
+
+    /// @brief Call task for 0..count-1 on the calling thread and up to threads-1 workers, return when all are done.
+    ///        Runs everything on the calling thread while another caller uses the workers.
+    /// @param task Must not throw.
+    void Run(size_t count, size_t threads, const std::function<void(size_t)>& task);
+
+private:
+    XmlThreadPool() = default;
+
+    void Work(uint64_t generation);
+    void Drain();
+
+    std::mutex              run_mutex_;
+    std::mutex              mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    size_t                  workers_    = 0;
+    uint64_t                generation_ = 0;
+    /// @brief Workers which may still join the current run.
+    size_t wanted_ = 0;
+    /// @brief Workers in the current run.
+    size_t active_ = 0;
+
+    const std::function<void(size_t)>* task_  = nullptr;
+    size_t                             count_ = 0;
+    std::atomic<size_t>                next_  = 0;
+};
+
+}
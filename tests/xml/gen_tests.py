@@ -55,6 +55,29 @@ def main():
                     else:
                         f.write("CHECK_FALSE(runner.HasIssues());")
 
+                    # patch again in every mode, the output must not change and no issues be added
+                    f.write("\nconst auto output = runner.Output();\n")
+                    f.write("const auto issues = runner.HasIssues();\n")
+                    for mode in data.get("modes", []):
+                        f.write("SECTION(\"%s\") {\n" % mode)
+                        f.write(
+                            "TestRunner mode_runner(\"%s\", \"%s\", \"%s\");\n" %
+                            (os.path.join("tests", "xml", test_type).replace(
+                                "\\", "/"), base_name_input.replace("\\", "/"),
+                             base_name_patch.replace("\\", "/")))
+                        f.write("REQUIRE(mode_runner.UseMode(\"%s\"));\n" % mode)
+                        f.write("mode_runner.ApplyPatches(mod_ids);\n")
+                        f.write("INFO(mode_runner.DumpLog());")
+                        f.write("CHECK(mode_runner.Output() == output);")
+                        f.write("CHECK((issues || !mode_runner.HasIssues()));")
+                        affected = data.get("affected")
+                        if mode == "accessLog" and affected is not None:
+                            f.write("CHECK(mode_runner.GetAffectedLines(\"%s\") == std::vector<size_t>{%s});" %
+                                    (affected['guid'],
+                                     ", ".join(str(line) for line in affected['lines'])))
+                        f.write("CHECK(mode_runner.ModeHolds());")
+                        f.write("}\n")
+
                     f.write("}\n\n")
 
 
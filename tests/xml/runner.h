@@ -2,11 +2,21 @@
 #include "spdlog/sinks/ostream_sink.h"
 #include "spdlog/spdlog.h"
 
+#include "xml_access_log.h"
+#include "xml_arena.h"
+#include "xml_index.h"
+#include "xml_journal.h"
+#include "xml_lazy_document.h"
+#include "xml_memory.h"
 #include "xml_operations.h"
+#include "xml_printer.h"
+#include "xml_shared_tree.h"
 
 #include "catch2/catch.hpp"
 
 #include <cstring>
+#include <fstream>
+#include <iterator>
 #include <memory>
 #include <set>
 #include <sstream>
@@ -18,7 +28,8 @@ using namespace xmlops;
 class TestRunner
 {
 public:
-    TestRunner(std::string_view mod_base_path, std::string_view input, std::string_view patch) {
+    TestRunner(std::string_view mod_base_path, std::string_view input, std::string_view patch)
+        : mod_base_path_(fs::absolute(mod_base_path)), input_(input), patch_(fs::absolute(patch)) {
         {
             auto sink = std::make_shared<spdlog::sinks::ostream_sink_st>(test_log_);
             auto test_logger = std::make_shared<spdlog::logger>("test_logger", sink);
@@ -27,12 +38,126 @@ public:
             spdlog::set_default_logger(test_logger);
         }
         {
-            xml_operations_ = XmlOperation::GetXmlOperationsFromFile(fs::absolute(patch), "", input, fs::absolute(mod_base_path));
-        }
-        {
-            input_doc_ = std::make_shared<pugi::xml_document>();
+            input_doc_ = XmlArena::MakeDocument();
             input_doc_->load_file(input.data());
+            input_xml_ = DumpXml();
+        }
+    }
+
+    /// @brief Patch in another way before ApplyPatches, the output must stay the same without new issues.
+    ///        arena: parse the input into an arena.
+    ///        memory: count pugixml allocations.
+    ///        lazy, lazyAll: parse assets only when ops reach them, some of them or all.
+    ///        lookupThreads: look up batches of ops on three threads however cheap.
+    ///        parallelPrint: print on more threads afterwards.
+    ///        journal: record changes and roll them back afterwards.
+    ///        accessLog: record the keyed elements ops read and write.
+    ///        shared: copy the result into a shared tree and change both afterwards.
+    ///        pruneModIds: skip ops excluded by mod IDs when reading them like the mod manager, so their
+    ///                     paths and includes report no issues.
+    /// @returns false for unknown modes.
+    bool UseMode(std::string_view mode) {
+        mode_ = mode;
+        if (mode == "arena") {
+            restore_.arena = true;
+            XmlArena::Install();
+            input_doc_ = XmlArena::MakeDocument();
+            XmlArena::Scope arena{input_doc_};
+            input_doc_->load_file(input_.data());
+        }
+        else if (mode == "memory") {
+            restore_.arena = true;
+            restore_.memory = true;
+            XmlArena::Install();
+            XmlMemory::CountBlocks(true);
+            parse_bytes_ = XmlMemory::GetStage(XmlMemory::Stage::Parse).total;
+        }
+        else if (mode == "lazy" || mode == "lazyAll") {
+            std::ifstream file{input_, std::ios::binary};
+            std::string content{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+            pugi::xml_parse_result result;
+            input_doc_ = XmlLazyDocument::Load(std::move(content), result);
+        }
+        else if (mode == "lookupThreads") {
+            restore_.lookup_threads = true;
+            XmlOperation::SetLookupThreads(3);
+            parallel_lookups_ = XmlOperation::GetParallelLookups();
+        }
+        else if (mode == "journal") {
+            XmlJournal::Start(input_doc_);
+        }
+        else if (mode == "accessLog") {
+            XmlAccessLog::Start(input_doc_);
+        }
+        else if (mode == "pruneModIds") {
+            prune_mod_ids_ = true;
+        }
+        else if (mode != "parallelPrint" && mode != "shared") {
+            return false;
+        }
+        return true;
+    }
+
+    /// @brief What the mode is about happened. Call after comparing the output, it may change the document.
+    bool ModeHolds() {
+        if (mode_ == "arena") {
+            return XmlArena::IsInstalled() && XmlArena::GetStats().arena_allocations > 0;
+        }
+        if (mode_ == "memory") {
+            // parsing the patch counted for its stage and file
+            const auto named = XmlMemory::GetNamed();
+            const auto patch = named.find(patch_.filename().generic_string());
+            return XmlMemory::GetStage(XmlMemory::Stage::Parse).total > parse_bytes_ && patch != named.end() &&
+                   patch->second.peak > 0;
+        }
+        if (mode_ == "lazy" || mode_ == "lazyAll") {
+            const auto stats = XmlLazyDocument::Get(input_doc_)->GetStats();
+            return mode_ == "lazy" ? stats.materialized > 0 && stats.materialized < stats.assets
+                                   : stats.materialized == stats.assets;
+        }
+        if (mode_ == "lookupThreads") {
+            return XmlOperation::GetParallelLookups() > parallel_lookups_;
+        }
+        if (mode_ == "parallelPrint") {
+            return PrintsInParallel();
+        }
+        if (mode_ == "journal") {
+            XmlJournal::Get(input_doc_)->Rollback(0);
+            return DumpXml() == input_xml_;
+        }
+        if (mode_ == "accessLog") {
+            return !XmlAccessLog::Get(input_doc_)->GetEntries().empty();
+        }
+        if (mode_ == "shared") {
+            return SharedTreeMatchesDocument();
         }
+        return mode_ == "pruneModIds" && !HasIssues();
+    }
+
+    /// @brief Raw XML of the patched document, unparsed assets of lazy documents included.
+    std::string Output() {
+        if (XmlLazyDocument::Get(input_doc_)) {
+            struct string_writer : pugi::xml_writer {
+                std::string result;
+                void write(const void* data, size_t size) override { result.append(static_cast<const char*>(data), size); }
+            } writer;
+            XmlLazyDocument::Print(input_doc_, writer);
+            return writer.result;
+        }
+        return Raw(*input_doc_);
+    }
+
+    /// @brief Patch lines of the ops to look at again if the asset with guid changed before them.
+    ///        Needs the accessLog mode.
+    std::vector<size_t> GetAffectedLines(const std::string& guid) {
+        const auto log = XmlAccessLog::Get(input_doc_);
+        XmlAccessSet changed;
+        changed.Add(XmlIndex::ASSET_RULE, guid);
+        std::vector<size_t> lines;
+        for (auto i : log->GetAffected(changed)) {
+            lines.push_back(log->GetEntries()[i].line);
+        }
+        return lines;
     }
 
     void ApplyPatches(const std::set<std::string>& mod_ids) {
@@ -40,9 +165,13 @@ public:
             spdlog::debug("{}", id);
         }
 
-        for (auto& operation : xml_operations_) {
-            operation.Apply(input_doc_, mod_ids);
+        // through the same entry point as the mod manager, ops excluded by the mod IDs aren't even compiled
+        if (prune_mod_ids_) {
+            XmlOperation::ApplyFile(input_doc_, patch_, "", input_, mod_base_path_, mod_ids);
+            return;
         }
+        xml_operations_ = ReadPatch(mod_ids);
+        XmlOperation::ApplyAll(xml_operations_, input_doc_, mod_ids);
     }
 
     auto GetPatchedDoc() {
@@ -84,7 +213,92 @@ public:
         spdlog::drop("test_logger");
     }
 private:
+    /// @brief Undo process-wide settings of a test, after all of its documents are gone.
+    struct Restore {
+        bool arena = false;
+        bool memory = false;
+        bool lookup_threads = false;
+        ~Restore() {
+            if (lookup_threads) {
+                XmlOperation::SetLookupThreads(0);
+            }
+            if (memory) {
+                XmlMemory::CountBlocks(false);
+            }
+            if (arena) {
+                XmlArena::Uninstall();
+            }
+        }
+    };
+
+    /// @brief Printing on two and three threads gives the same XML as pugixml, raw and indented.
+    bool PrintsInParallel() {
+        for (const auto flags : {pugi::format_raw, pugi::format_default}) {
+            for (const size_t threads : {2, 3}) {
+                std::ostringstream serial;
+                std::ostringstream parallel;
+                pugi::xml_writer_stream writer{parallel};
+                input_doc_->print(serial, "   ", flags);
+                XmlPrinter::Print(*input_doc_, writer, "   ", flags, threads);
+                if (serial.str() != parallel.str()) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    /// @brief A shared copy prints the same XML and saves memory.
+    ///        Removing the first `Cost` from both leaves identical ones in other assets untouched,
+    ///        and the replaced nodes are reclaimed.
+    bool SharedTreeMatchesDocument() {
+        const auto tree = XmlSharedTree::Build(*input_doc_);
+        const auto same = [this, &tree]() {
+            std::stringstream printed;
+            tree->Print(printed, tree->Root());
+            pugi::xml_document reparsed;
+            reparsed.load_string(printed.str().c_str());
+            pugi::xml_document copy;
+            tree->CopyTo(tree->Root(), copy);
+            return Raw(reparsed) == Raw(*input_doc_) && Raw(copy) == Raw(*input_doc_);
+        };
+        if (!same() || tree->GetStats().saved_bytes == 0) {
+            return false;
+        }
+
+        const auto stored = tree->GetStats().stored_nodes;
+        auto cost = input_doc_->select_node("//Cost").node();
+        if (!cost || !tree->Remove(XmlSharedTree::GetPath(cost))) {
+            return false;
+        }
+        cost.parent().remove_child(cost);
+        return same() && tree->GetStats().stored_nodes <= stored;
+    }
+
+    static std::string Raw(const pugi::xml_node& node) {
+        std::stringstream ss;
+        node.print(ss, "", pugi::format_raw);
+        return ss.str();
+    }
+
+    std::vector<XmlOperation> ReadPatch(const std::set<std::string>& mod_ids) {
+        return XmlOperation::GetXmlOperationsFromFile(patch_, "", input_, mod_base_path_,
+                                                      prune_mod_ids_ ? &mod_ids : nullptr);
+    }
+
+    /// @brief Destroyed last.
+    Restore restore_;
+    fs::path mod_base_path_;
+    std::string input_;
+    fs::path patch_;
+    /// @brief Includes are shared within a test like within one patching pass of the mod manager.
+    XmlOperationContext::IncludeCachePass include_cache_pass_;
     std::vector<XmlOperation> xml_operations_;
     std::shared_ptr<pugi::xml_document> input_doc_ = nullptr;
+    std::string input_xml_;
+    size_t parse_bytes_ = 0;
+    size_t parallel_lookups_ = 0;
+    bool prune_mod_ids_ = false;
+    std::string mode_;
     std::ostringstream test_log_;
 };